@@ -0,0 +1,37 @@
+-- Measures how many videos can be opened (and their first frame decoded) per
+-- second with different open options.
+--
+-- Without a path, both test videos are measured: an MPEG-PS file, whose
+-- streams are only discovered by reading packets, and a Matroska file, whose
+-- header describes its streams so trusted params skip probing entirely.
+--
+-- Usage: th bench/open_bench.lua [path] [n_opens]
+
+require('torch')
+local torchvid = require('torchvid')
+
+local paths = arg[1] and {arg[1]} or {
+  './test/data/centaur_1.mpg',
+  './test/data/multi_stream.mkv'
+}
+local n_opens = tonumber(arg[2]) or 200
+
+local function bench(path, name, options)
+  collectgarbage()
+  local timer = torch.Timer()
+  for i = 1, n_opens do
+    torchvid.Video.new(path, options):next_image_frame()
+  end
+  collectgarbage()
+  local elapsed = timer:time().real
+  print(string.format('%-16s %10.1f opens/s', name, n_opens / elapsed))
+end
+
+for _, path in ipairs(paths) do
+  print(path)
+  local params = torchvid.Video.new(path):stream_params()
+
+  bench(path, 'default', nil)
+  bench(path, 'bounded probe', {probesize = 32768, analyzeduration = 100000})
+  bench(path, 'trusted params', {stream_params = params})
+end
@@ -6,14 +6,18 @@
 #define CONCAT_4(x,y,z,w) CONCAT_4_EXPAND(x,y,z,w)
 
 #define pack_(T) CONCAT_4(pack_, T, _as_, TYPE)
+#define unpack_(T) CONCAT_4(unpack_, T, _from_, TYPE)
 
-static TYPE* pack_(rgb24)(TYPE *dest, AVFrame *frame) {
-  int triple_x_max = frame->width * 3;
+static TYPE* pack_(rgb24)(TYPE *dest, AVFrame *frame, const PackRegion *region) {
+  int triple_x_min = region->x * 3;
+  int triple_x_max = (region->x + region->width) * 3;
+  int triple_x_step = region->stride * 3;
+  int y_max = region->y + region->height;
   int i, y, triple_x;
   for(i = 0; i < 3; ++i) {
-    for(y = 0; y < frame->height; ++y) {
+    for(y = region->y; y < y_max; y += region->stride) {
       int offset = y * frame->linesize[0] + i;
-      for(triple_x = 0; triple_x < triple_x_max; triple_x += 3) {
+      for(triple_x = triple_x_min; triple_x < triple_x_max; triple_x += triple_x_step) {
         *dest++ = frame->data[0][offset + triple_x];
       }
     }
@@ -22,108 +26,201 @@ static TYPE* pack_(rgb24)(TYPE *dest, AVFrame *frame) {
   return dest;
 }
 
-static TYPE* pack_(gray8)(TYPE *dest, AVFrame *frame) {
+// Packs one plane, where `x_shift` and `y_shift` are the log2 chroma
+// subsampling factors which map region coordinates to plane coordinates.
+static TYPE* pack_(plane)(TYPE *dest, AVFrame *frame, int plane,
+  const PackRegion *region, int x_shift, int y_shift)
+{
   int y, x;
-  int stride = frame->linesize[0];
-  unsigned char *channel_data = frame->data[0];
-  for(y = 0; y < frame->height; ++y) {
-    int offset = stride * y;
-    for(x = 0; x < frame->width; ++x) {
-      *dest++ = channel_data[offset + x];
+  int stride = frame->linesize[plane];
+  unsigned char *channel_data = frame->data[plane];
+  int x_max = region->x + region->width;
+  int y_max = region->y + region->height;
+  for(y = region->y; y < y_max; y += region->stride) {
+    unsigned char *row = channel_data + stride * (y >> y_shift);
+    for(x = region->x; x < x_max; x += region->stride) {
+      *dest++ = row[x >> x_shift];
     }
   }
 
   return dest;
 }
 
-static TYPE* pack_(yuv444p)(TYPE *dest, AVFrame *frame) {
+static TYPE* pack_(gray8)(TYPE *dest, AVFrame *frame, const PackRegion *region) {
+  return pack_(plane)(dest, frame, 0, region, 0, 0);
+}
+
+static TYPE* pack_(yuv444p)(TYPE *dest, AVFrame *frame, const PackRegion *region) {
   // Luma
-  dest = pack_(gray8)(dest, frame);
+  dest = pack_(plane)(dest, frame, 0, region, 0, 0);
 
   // Chroma
-  int i, y, x;
-  for(i = 1; i < 3; ++i) {
-    int stride = frame->linesize[i];
-    unsigned char *channel_data = frame->data[i];
-    for(y = 0; y < frame->height; ++y) {
-      int offset = stride * y;
-      for(x = 0; x < frame->width; ++x) {
-        *dest++ = channel_data[offset + x];
-      }
-    }
-  }
+  dest = pack_(plane)(dest, frame, 1, region, 0, 0);
+  dest = pack_(plane)(dest, frame, 2, region, 0, 0);
 
   return dest;
 }
 
-static TYPE* pack_(yuv420p)(TYPE *dest, AVFrame *frame) {
+static TYPE* pack_(yuv420p)(TYPE *dest, AVFrame *frame, const PackRegion *region) {
   // Luma
-  dest = pack_(gray8)(dest, frame);
+  dest = pack_(plane)(dest, frame, 0, region, 0, 0);
 
-  // Chroma
-  int i, y, x;
-  int odd_width = frame->width & 1;
-  int half_width = frame->width >> 1;
-  for(i = 1; i < 3; ++i) {
-    int stride = frame->linesize[i];
-    unsigned char *channel_data = frame->data[i];
-    for(y = 0; y < frame->height; ++y) {
-      int offset = stride * (y >> 1);
-      for(x = 0; x < half_width; ++x) {
-        *dest++ = channel_data[offset + x];
-        *dest++ = channel_data[offset + x];
-      }
-      if(odd_width) {
-        *dest++ = channel_data[offset + x];
-      }
-    }
-  }
+  // Chroma (half width, half height)
+  dest = pack_(plane)(dest, frame, 1, region, 1, 1);
+  dest = pack_(plane)(dest, frame, 2, region, 1, 1);
 
   return dest;
 }
 
-static TYPE* pack_(yuv422p)(TYPE *dest, AVFrame *frame) {
+static TYPE* pack_(yuv422p)(TYPE *dest, AVFrame *frame, const PackRegion *region) {
   // Luma
-  dest = pack_(gray8)(dest, frame);
+  dest = pack_(plane)(dest, frame, 0, region, 0, 0);
 
-  // Chroma
-  int i, y, x;
-  int odd_width = frame->width & 1;
-  int half_width = frame->width >> 1;
-  for(i = 1; i < 3; ++i) {
-    int stride = frame->linesize[i];
-    unsigned char *channel_data = frame->data[i];
+  // Chroma (half width, full height)
+  dest = pack_(plane)(dest, frame, 1, region, 1, 0);
+  dest = pack_(plane)(dest, frame, 2, region, 1, 0);
+
+  return dest;
+}
+
+static int pack_(any)(TYPE *dest, AVFrame *frame, const PackRegion *region) {
+  switch(frame->format) {
+    case AV_PIX_FMT_RGB24:
+      pack_(rgb24)(dest, frame, region);
+      break;
+    case AV_PIX_FMT_GRAY8:
+      pack_(gray8)(dest, frame, region);
+      break;
+    case AV_PIX_FMT_YUV444P:
+      pack_(yuv444p)(dest, frame, region);
+      break;
+    case AV_PIX_FMT_YUV420P:
+      pack_(yuv420p)(dest, frame, region);
+      break;
+    case AV_PIX_FMT_YUV422P:
+      pack_(yuv422p)(dest, frame, region);
+      break;
+    default:
+      return -1;
+  }
+
+  return 0;
+}
+
+// Rounds and clamps a value in the range [0, 255] to a byte
+static unsigned char unpack_(value)(TYPE value) {
+  if(value <= 0) return 0;
+  if(value >= 255) return 255;
+  return (unsigned char)(value + 0.5f);
+}
+
+static const TYPE* unpack_(rgb24)(AVFrame *frame, const TYPE *src) {
+  int triple_x_max = frame->width * 3;
+  int i, y, triple_x;
+  for(i = 0; i < 3; ++i) {
     for(y = 0; y < frame->height; ++y) {
-      int offset = stride * y;
-      for(x = 0; x < half_width; ++x) {
-        *dest++ = channel_data[offset + x];
-        *dest++ = channel_data[offset + x];
+      int offset = y * frame->linesize[0] + i;
+      for(triple_x = 0; triple_x < triple_x_max; triple_x += 3) {
+        frame->data[0][offset + triple_x] = unpack_(value)(*src++);
       }
-      if(odd_width) {
-        *dest++ = channel_data[offset + x];
+    }
+  }
+
+  return src;
+}
+
+// Unpacks one full-size channel into a plane, averaging over each block of
+// pixels covered by a subsampled plane sample (the inverse of pack_(plane)).
+static const TYPE* unpack_(plane)(AVFrame *frame, int plane, const TYPE *src,
+  int x_shift, int y_shift)
+{
+  int stride = frame->linesize[plane];
+  unsigned char *channel_data = frame->data[plane];
+  int width = frame->width;
+  int height = frame->height;
+  int x, y;
+
+  if(x_shift == 0 && y_shift == 0) {
+    for(y = 0; y < height; ++y) {
+      unsigned char *row = channel_data + stride * y;
+      for(x = 0; x < width; ++x) {
+        row[x] = unpack_(value)(*src++);
       }
     }
+    return src;
   }
 
-  return dest;
+  int plane_width = -((-width) >> x_shift);
+  int plane_height = -((-height) >> y_shift);
+  int plane_x, plane_y, dx, dy;
+  for(plane_y = 0; plane_y < plane_height; ++plane_y) {
+    unsigned char *row = channel_data + stride * plane_y;
+    for(plane_x = 0; plane_x < plane_width; ++plane_x) {
+      float sum = 0;
+      int count = 0;
+      for(dy = 0; dy < (1 << y_shift); ++dy) {
+        y = (plane_y << y_shift) + dy;
+        if(y >= height) break;
+        for(dx = 0; dx < (1 << x_shift); ++dx) {
+          x = (plane_x << x_shift) + dx;
+          if(x >= width) break;
+          sum += src[y * width + x];
+          ++count;
+        }
+      }
+      row[plane_x] = unpack_(value)(sum / count);
+    }
+  }
+
+  return src + width * height;
+}
+
+static const TYPE* unpack_(gray8)(AVFrame *frame, const TYPE *src) {
+  return unpack_(plane)(frame, 0, src, 0, 0);
+}
+
+static const TYPE* unpack_(yuv444p)(AVFrame *frame, const TYPE *src) {
+  src = unpack_(plane)(frame, 0, src, 0, 0);
+  src = unpack_(plane)(frame, 1, src, 0, 0);
+  src = unpack_(plane)(frame, 2, src, 0, 0);
+
+  return src;
+}
+
+static const TYPE* unpack_(yuv420p)(AVFrame *frame, const TYPE *src) {
+  src = unpack_(plane)(frame, 0, src, 0, 0);
+  src = unpack_(plane)(frame, 1, src, 1, 1);
+  src = unpack_(plane)(frame, 2, src, 1, 1);
+
+  return src;
+}
+
+static const TYPE* unpack_(yuv422p)(AVFrame *frame, const TYPE *src) {
+  src = unpack_(plane)(frame, 0, src, 0, 0);
+  src = unpack_(plane)(frame, 1, src, 1, 0);
+  src = unpack_(plane)(frame, 2, src, 1, 0);
+
+  return src;
 }
 
-static int pack_(any)(TYPE *dest, AVFrame *frame) {
+// Fills a frame from tensor data in the layout produced by pack_(any). Values
+// must be in the range [0, 255].
+static int unpack_(any)(AVFrame *frame, const TYPE *src) {
   switch(frame->format) {
     case AV_PIX_FMT_RGB24:
-      pack_(rgb24)(dest, frame);
+      unpack_(rgb24)(frame, src);
       break;
     case AV_PIX_FMT_GRAY8:
-      pack_(gray8)(dest, frame);
+      unpack_(gray8)(frame, src);
       break;
     case AV_PIX_FMT_YUV444P:
-      pack_(yuv444p)(dest, frame);
+      unpack_(yuv444p)(frame, src);
       break;
     case AV_PIX_FMT_YUV420P:
-      pack_(yuv420p)(dest, frame);
+      unpack_(yuv420p)(frame, src);
       break;
     case AV_PIX_FMT_YUV422P:
-      pack_(yuv422p)(dest, frame);
+      unpack_(yuv422p)(frame, src);
       break;
     default:
       return -1;
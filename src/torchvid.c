@@ -9,6 +9,7 @@
 
 #if LUA_VERSION_NUM < 502
 # define luaL_newlib(L,l) (lua_newtable(L), luaL_register(L,NULL,l))
+# define lua_rawlen(L,i) lua_objlen(L,i)
 #endif
 
 void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
@@ -36,11 +37,30 @@ void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 #include <libavfilter/buffersink.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/opt.h>
+#include <libswscale/swscale.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 typedef unsigned char byte;
 
+// Rectangular region of a frame to pack, sampling every `stride` pixels.
+typedef struct {
+  int x;
+  int y;
+  int width;
+  int height;
+  int stride;
+} PackRegion;
+
 #define TYPE float
 #include "pack_as.h"
 #undef TYPE
@@ -49,20 +69,74 @@ typedef unsigned char byte;
 #include "pack_as.h"
 #undef TYPE
 
+static const char* get_string_field(lua_State *L, int index, const char *name,
+  const char *default_value)
+{
+  lua_getfield(L, index, name);
+  const char *value = default_value;
+  if(!lua_isnil(L, -1)) {
+    if(!lua_isstring(L, -1)) {
+      luaL_error(L, "option '%s' must be a string", name);
+    }
+    // The string is still referenced by the options table, so it stays valid
+    value = lua_tostring(L, -1);
+  }
+  lua_pop(L, 1);
+  return value;
+}
+
+static lua_Integer get_integer_field(lua_State *L, int index, const char *name,
+  lua_Integer default_value)
+{
+  lua_getfield(L, index, name);
+  lua_Integer value = default_value;
+  if(!lua_isnil(L, -1)) {
+    if(!lua_isnumber(L, -1)) {
+      luaL_error(L, "option '%s' must be a number", name);
+    }
+    value = lua_tointeger(L, -1);
+  }
+  lua_pop(L, 1);
+  return value;
+}
+
+static lua_Number get_number_field(lua_State *L, int index, const char *name,
+  lua_Number default_value)
+{
+  lua_getfield(L, index, name);
+  lua_Number value = default_value;
+  if(!lua_isnil(L, -1)) {
+    if(!lua_isnumber(L, -1)) {
+      luaL_error(L, "option '%s' must be a number", name);
+    }
+    value = lua_tonumber(L, -1);
+  }
+  lua_pop(L, 1);
+  return value;
+}
+
 typedef enum {
   TVError_None = 0,
   TVError_EOF,
   TVError_ReadFail,
   TVError_DecodeFail,
-  TVError_FilterFail
+  TVError_FilterFail,
+  TVError_SeekFail
 } TVError;
 
+typedef enum {
+  TVChangeDetection_None = 0,
+  TVChangeDetection_Luma,
+  TVChangeDetection_PacketSize
+} TVChangeDetection;
+
 /***
 @type ImageFrame
 */
 typedef struct {
   AVFrame *frame;
   float timestamp;
+  float change_score;
 } ImageFrame;
 
 static int calculate_tensor_channels(AVFrame *frame) {
@@ -81,20 +155,109 @@ static int calculate_tensor_channels(AVFrame *frame) {
   return n_channels;
 }
 
+// Returns the ImageFrame at the given index, raising an error if its pixel
+// data is no longer available.
+static ImageFrame* check_image_frame_data(lua_State *L, int index) {
+  ImageFrame *self = (ImageFrame*)luaL_checkudata(L, index, "ImageFrame");
+  if(self->frame == NULL) {
+    luaL_error(L, "image frame data is no longer available");
+  }
+  return self;
+}
+
+static void check_pack_region(lua_State *L, int index, AVFrame *frame,
+  PackRegion *region)
+{
+  region->x = 0;
+  region->y = 0;
+  region->width = frame->width;
+  region->height = frame->height;
+  region->stride = 1;
+
+  if(lua_gettop(L) < index || lua_isnil(L, index)) {
+    return;
+  }
+
+  luaL_checktype(L, index, LUA_TTABLE);
+
+  // Validate at full width before narrowing, so that huge values can't wrap
+  lua_Integer x = get_integer_field(L, index, "x", 0);
+  lua_Integer y = get_integer_field(L, index, "y", 0);
+  luaL_argcheck(L, x >= 0 && x < frame->width && y >= 0 && y < frame->height,
+    index, "crop region out of frame bounds");
+
+  lua_Integer width = get_integer_field(L, index, "width", frame->width - x);
+  lua_Integer height = get_integer_field(L, index, "height", frame->height - y);
+  luaL_argcheck(L,
+    width > 0 && width <= frame->width - x &&
+    height > 0 && height <= frame->height - y,
+    index, "crop region out of frame bounds");
+
+  lua_Integer stride = get_integer_field(L, index, "stride", 1);
+  luaL_argcheck(L, stride >= 1, index, "stride must be at least 1");
+
+  // Any stride beyond the region size selects a single pixel
+  region->x = x;
+  region->y = y;
+  region->width = width;
+  region->height = height;
+  region->stride = FFMIN(stride, FFMAX(width, height));
+}
+
+static int region_output_size(int size, int stride) {
+  return (size + stride - 1) / stride;
+}
+
+// Rescales packed C x H x W pixel values from [0, 255] to the ranges
+// documented for `to_float_tensor`.
+static void normalize_float_tensor(THFloatTensor *tensor, AVFrame *frame) {
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+  int is_yuv = !(desc->flags & PIX_FMT_RGB) && desc->nb_components >= 2;
+
+  if(is_yuv) {
+    THFloatTensor *tensor_y = THFloatTensor_newSelect(tensor, 0, 0);
+    THFloatTensor_div(tensor_y, tensor_y, 255);
+    THFloatTensor_free(tensor_y);
+
+    THFloatTensor *tensor_u = THFloatTensor_newSelect(tensor, 0, 1);
+    THFloatTensor_div(tensor_u, tensor_u, 128);
+    THFloatTensor_add(tensor_u, tensor_u, -1);
+    THFloatTensor_free(tensor_u);
+
+    THFloatTensor *tensor_v = THFloatTensor_newSelect(tensor, 0, 2);
+    THFloatTensor_div(tensor_v, tensor_v, 128);
+    THFloatTensor_add(tensor_v, tensor_v, -1);
+    THFloatTensor_free(tensor_v);
+  } else {
+    THFloatTensor_div(tensor, tensor, 255);
+  }
+}
+
 /***
 Copies video frame pixel data into a `torch.ByteTensor`.
 
+Only the pixels in the optional crop region are copied, so extracting a small
+crop costs much less than packing the whole frame. The region is a table with
+the fields `x`, `y` (zero-based offsets, default 0), `width`, `height`
+(default to the rest of the frame) and `stride` (take every nth pixel in each
+dimension, default 1).
+
 @function to_byte_tensor
+@tparam[opt] table region Crop region and spatial stride.
 @treturn torch.ByteTensor A tensor representation of the pixel data.
 */
 static int ImageFrame_to_byte_tensor(lua_State *L) {
-  ImageFrame *self = (ImageFrame*)luaL_checkudata(L, 1, "ImageFrame");
+  ImageFrame *self = check_image_frame_data(L, 1);
+
+  PackRegion region;
+  check_pack_region(L, 2, self->frame, &region);
 
   int n_channels = calculate_tensor_channels(self->frame);
-  THByteTensor *tensor = THByteTensor_newWithSize3d(
-    n_channels, self->frame->height, self->frame->width);
+  THByteTensor *tensor = THByteTensor_newWithSize3d(n_channels,
+    region_output_size(region.height, region.stride),
+    region_output_size(region.width, region.stride));
 
-  if(pack_any_as_byte(tensor->storage->data, self->frame) < 0) {
+  if(pack_any_as_byte(tensor->storage->data, self->frame, &region) < 0) {
     THByteTensor_free(tensor);
     return luaL_error(L, "unsupported pixel format");
   }
@@ -111,41 +274,29 @@ For most pixel formats, this means that all channels will contain values between
 0 and 1. If the pixel format is YUV, the chroma channels will contain values
 between -1 and 1.
 
+Accepts the same optional crop region as `to_byte_tensor`.
+
 @function to_float_tensor
+@tparam[opt] table region Crop region and spatial stride.
 @treturn torch.FloatTensor A tensor representation of the pixel data.
 */
 static int ImageFrame_to_float_tensor(lua_State *L) {
-  ImageFrame *self = (ImageFrame*)luaL_checkudata(L, 1, "ImageFrame");
+  ImageFrame *self = check_image_frame_data(L, 1);
+
+  PackRegion region;
+  check_pack_region(L, 2, self->frame, &region);
 
   int n_channels = calculate_tensor_channels(self->frame);
-  THFloatTensor *tensor = THFloatTensor_newWithSize3d(
-    n_channels, self->frame->height, self->frame->width);
+  THFloatTensor *tensor = THFloatTensor_newWithSize3d(n_channels,
+    region_output_size(region.height, region.stride),
+    region_output_size(region.width, region.stride));
 
-  if(pack_any_as_float(tensor->storage->data, self->frame) < 0) {
+  if(pack_any_as_float(tensor->storage->data, self->frame, &region) < 0) {
     THFloatTensor_free(tensor);
     return luaL_error(L, "unsupported pixel format");
   }
 
-  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(self->frame->format);
-  int is_yuv = !(desc->flags & PIX_FMT_RGB) && desc->nb_components >= 2;
-
-  if(is_yuv) {
-    THFloatTensor *tensor_y = THFloatTensor_newSelect(tensor, 0, 0);
-    THFloatTensor_div(tensor_y, tensor_y, 255);
-    THFloatTensor_free(tensor_y);
-
-    THFloatTensor *tensor_u = THFloatTensor_newSelect(tensor, 0, 1);
-    THFloatTensor_div(tensor_u, tensor_u, 128);
-    THFloatTensor_add(tensor_u, tensor_u, -1);
-    THFloatTensor_free(tensor_u);
-
-    THFloatTensor *tensor_v = THFloatTensor_newSelect(tensor, 0, 2);
-    THFloatTensor_div(tensor_v, tensor_v, 128);
-    THFloatTensor_add(tensor_v, tensor_v, -1);
-    THFloatTensor_free(tensor_v);
-  } else {
-    THFloatTensor_div(tensor, tensor, 255);
-  }
+  normalize_float_tensor(tensor, self->frame);
 
   luaT_pushudata(L, tensor, "torch.FloatTensor");
 
@@ -166,6 +317,27 @@ static int ImageFrame_timestamp(lua_State *L) {
   return 1;
 }
 
+/***
+Get how much this frame differs from the previously decoded frame.
+
+Only available when the video was opened with the `change_detection` option.
+
+@function change_score
+@treturn number A score between 0 (identical) and 1, or nil if change
+  detection is disabled.
+*/
+static int ImageFrame_change_score(lua_State *L) {
+  ImageFrame *self = (ImageFrame*)luaL_checkudata(L, 1, "ImageFrame");
+
+  if(isnan(self->change_score)) {
+    lua_pushnil(L);
+  } else {
+    lua_pushnumber(L, self->change_score);
+  }
+
+  return 1;
+}
+
 static const luaL_Reg ImageFrame_functions[] = {
   {NULL, NULL}
 };
@@ -174,6 +346,7 @@ static const luaL_Reg ImageFrame_methods[] = {
   {"to_byte_tensor", ImageFrame_to_byte_tensor},
   {"to_float_tensor", ImageFrame_to_float_tensor},
   {"timestamp", ImageFrame_timestamp},
+  {"change_score", ImageFrame_change_score},
   {NULL, NULL}
 };
 
@@ -190,6 +363,32 @@ static void register_ImageFrame(lua_State *L, int m) {
   lua_setfield(L, m, "ImageFrame");
 }
 
+#define MAX_SYNC_STREAMS 16
+
+// Decoding state for one of several video streams read in lockstep
+typedef struct {
+  int stream_index;
+  AVRational time_base;
+  AVCodecContext *decoder_context;
+  AVFrame *frame;
+  AVFilterGraph *filter_graph;
+  AVFilterContext *buffersrc_context;
+  AVFilterContext *buffersink_context;
+  AVFrame *filtered_frame;
+  // Decoded frames not yet superseded, in presentation order
+  AVFrame **queue;
+  int queue_length;
+  int queue_capacity;
+  // Frame selected for the most recent frame set
+  AVFrame *current;
+  float current_timestamp;
+  // Timestamp of the first frame, from the container or the first demuxed
+  // packet, and of the newest decoded frame (NAN if unknown)
+  float first_timestamp;
+  float last_timestamp;
+  int eof;
+} SyncStream;
+
 /***
 @type Video
 */
@@ -205,38 +404,477 @@ typedef struct {
   AVFilterContext *buffersink_context;
   AVFrame *filtered_frame;
   int64_t seek_pts;
+  SyncStream *sync_streams;
+  int n_sync_streams;
+  float sync_tolerance;
+  float sync_lookahead;
+  // Newest packet timestamp demuxed from any synced stream, and timestamp of
+  // the most recently dequeued reference frame
+  float demux_timestamp;
+  float sync_timestamp;
+  TVChangeDetection change_detection;
+  int change_detection_step;
+  // Downsampled luma of the current and previous decoded frames
+  byte *luma;
+  byte *previous_luma;
+  size_t luma_size;
+  int has_previous_luma;
+  // Compressed size of the most recent keyframe
+  int keyframe_packet_size;
+  float change_score;
 } Video;
 
+typedef struct {
+  SyncStream *streams;
+  int n_streams;
+} ImageFrameSet;
+
+static const char* apply_stream_params(lua_State *L, int index, Video *self,
+  AVCodec **decoder)
+{
+  lua_Integer stream_index = get_integer_field(L, index, "stream_index", -1);
+  const char *codec_name = get_string_field(L, index, "codec", NULL);
+  const char *pixel_format_name = get_string_field(L, index, "pixel_format", NULL);
+  lua_Integer width = get_integer_field(L, index, "width", 0);
+  lua_Integer height = get_integer_field(L, index, "height", 0);
+  lua_Integer time_base_num = get_integer_field(L, index, "time_base_num", 0);
+  lua_Integer time_base_den = get_integer_field(L, index, "time_base_den", 0);
+  lua_Integer frame_rate_num = get_integer_field(L, index, "frame_rate_num", 0);
+  lua_Integer frame_rate_den = get_integer_field(L, index, "frame_rate_den", 0);
+
+  if(!codec_name || !pixel_format_name || width <= 0 || height <= 0) {
+    return "stream_params requires codec, pixel_format, width and height";
+  }
+
+  *decoder = avcodec_find_decoder_by_name(codec_name);
+  if(*decoder == NULL) {
+    return "unknown codec in stream_params";
+  }
+
+  enum AVPixelFormat pix_fmt = av_get_pix_fmt(pixel_format_name);
+  if(pix_fmt == AV_PIX_FMT_NONE) {
+    return "invalid pixel format name in stream_params";
+  }
+
+  AVFormatContext *format_context = self->format_context;
+
+  // Some containers (eg MPEG-PS) only create streams as packets are read, so
+  // fall back to the smallest possible probe just to discover them.
+  if(format_context->nb_streams == 0) {
+    format_context->probesize = 32;
+    format_context->max_analyze_duration = 1;
+    if(avformat_find_stream_info(format_context, NULL) < 0) {
+      return "failed to find stream info";
+    }
+  }
+
+  if(stream_index < 0) {
+    unsigned int i;
+    for(i = 0; i < format_context->nb_streams; ++i) {
+      if(format_context->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        stream_index = i;
+        break;
+      }
+    }
+  }
+
+  if(stream_index < 0 || (unsigned int)stream_index >= format_context->nb_streams) {
+    return "failed to find video stream";
+  }
+
+  AVStream *stream = format_context->streams[stream_index];
+  AVCodecContext *codec_context = stream->codec;
+
+  codec_context->codec_type = AVMEDIA_TYPE_VIDEO;
+  codec_context->codec_id = (*decoder)->id;
+  codec_context->width = width;
+  codec_context->height = height;
+  codec_context->pix_fmt = pix_fmt;
+  if(time_base_num > 0 && time_base_den > 0) {
+    codec_context->time_base = av_make_q(time_base_num, time_base_den);
+  } else {
+    codec_context->time_base = stream->time_base;
+  }
+
+  // Without probing, the frame rate is otherwise unknown
+  if(frame_rate_num > 0 && frame_rate_den > 0) {
+    stream->r_frame_rate = av_make_q(frame_rate_num, frame_rate_den);
+    stream->avg_frame_rate = stream->r_frame_rate;
+  }
+
+  self->video_stream_index = stream_index;
+
+  return NULL;
+}
+
+// Returns the first of the given stream indices, or -1 if any of them is not
+// a video stream.
+static int check_sync_stream_indices(AVFormatContext *format_context,
+  const int *stream_indices, int n_streams)
+{
+  int i, j;
+  for(i = 0; i < n_streams; ++i) {
+    if(stream_indices[i] < 0 ||
+      (unsigned int)stream_indices[i] >= format_context->nb_streams ||
+      format_context->streams[stream_indices[i]]->codec->codec_type != AVMEDIA_TYPE_VIDEO)
+    {
+      return -1;
+    }
+    for(j = 0; j < i; ++j) {
+      if(stream_indices[j] == stream_indices[i]) return -1;
+    }
+  }
+  return stream_indices[0];
+}
+
+// Sets up lockstep decoding of several streams. The first stream shares the
+// already opened decoder of the reference stream.
+static int open_sync_streams(Video *self, const int *stream_indices,
+  int n_streams)
+{
+  unsigned int i;
+
+  self->sync_streams = av_mallocz_array(n_streams, sizeof(SyncStream));
+  self->n_sync_streams = n_streams;
+  self->demux_timestamp = -INFINITY;
+  self->sync_timestamp = -INFINITY;
+
+  for(i = 0; i < (unsigned int)n_streams; ++i) {
+    SyncStream *stream = &self->sync_streams[i];
+    AVStream *av_stream = self->format_context->streams[stream_indices[i]];
+
+    stream->stream_index = stream_indices[i];
+    stream->time_base = av_stream->time_base;
+    stream->frame = av_frame_alloc();
+    stream->current = av_frame_alloc();
+    stream->first_timestamp = av_stream->start_time != AV_NOPTS_VALUE ?
+      av_stream->start_time * av_q2d(av_stream->time_base) : NAN;
+    stream->last_timestamp = NAN;
+
+    if(i == 0) {
+      stream->decoder_context = self->image_decoder_context;
+      continue;
+    }
+
+    stream->decoder_context = av_stream->codec;
+    av_opt_set_int(stream->decoder_context, "refcounted_frames", 1, 0);
+    AVCodec *decoder = avcodec_find_decoder(stream->decoder_context->codec_id);
+    if(decoder == NULL || avcodec_open2(stream->decoder_context, decoder, NULL) < 0) {
+      stream->decoder_context = NULL;
+      return -1;
+    }
+  }
+
+  // Don't spend time demuxing streams which won't be decoded
+  for(i = 0; i < self->format_context->nb_streams; ++i) {
+    int j, selected = 0;
+    for(j = 0; j < n_streams; ++j) {
+      if(stream_indices[j] == (int)i) selected = 1;
+    }
+    if(!selected) {
+      self->format_context->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  return 0;
+}
+
+static int supports_luma_change_detection(enum AVPixelFormat pix_fmt) {
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+  return desc != NULL &&
+    !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL)) &&
+    desc->comp[0].plane == 0 &&
+    desc->comp[0].step_minus1 == 0 &&
+    desc->comp[0].depth_minus1 == 7;
+}
+
+// Sum of absolute differences over one row. The scalar loop is written in the
+// form which compilers recognise as a SAD pattern, for targets without SSE2.
+static unsigned int sum_abs_diff_row(const byte *a, const byte *b, int n) {
+  unsigned int sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for(; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+  for(; i < n; ++i) {
+    sum += abs((int)a[i] - b[i]);
+  }
+  return sum;
+}
+
+static float luma_change_score(Video *self, AVFrame *frame) {
+  if(!supports_luma_change_detection(frame->format)) {
+    self->has_previous_luma = 0;
+    return 1;
+  }
+
+  int step = self->change_detection_step;
+  int width = (frame->width + step - 1) / step;
+  int height = (frame->height + step - 1) / step;
+  size_t size = (size_t)width * height;
+
+  if(size != self->luma_size) {
+    av_free(self->luma);
+    av_free(self->previous_luma);
+    self->luma = av_malloc(size);
+    self->previous_luma = av_malloc(size);
+    self->luma_size = size;
+    self->has_previous_luma = 0;
+  }
+
+  // Downsample by taking every nth pixel of every nth row
+  byte *dest = self->luma;
+  int y, x;
+  for(y = 0; y < frame->height; y += step) {
+    const byte *row = frame->data[0] + y * frame->linesize[0];
+    if(step == 1) {
+      memcpy(dest, row, width);
+      dest += width;
+    } else {
+      for(x = 0; x < frame->width; x += step) {
+        *dest++ = row[x];
+      }
+    }
+  }
+
+  float score = 1;
+  if(self->has_previous_luma) {
+    uint64_t sum = 0;
+    for(y = 0; y < height; ++y) {
+      sum += sum_abs_diff_row(self->luma + (size_t)y * width,
+        self->previous_luma + (size_t)y * width, width);
+    }
+    score = sum / (255.0f * size);
+  }
+
+  byte *tmp = self->previous_luma;
+  self->previous_luma = self->luma;
+  self->luma = tmp;
+  self->has_previous_luma = 1;
+
+  return score;
+}
+
+// An inter frame codes only what changed since its references, so its size
+// relative to the latest keyframe (which codes the whole picture) approximates
+// how much changed. Keyframes are scored by how much their size differs from
+// the previous keyframe, since their own size reflects scene complexity.
+static float packet_size_change_score(Video *self, AVFrame *frame) {
+  int packet_size = av_frame_get_pkt_size(frame);
+  int keyframe_packet_size = self->keyframe_packet_size;
+
+  if(packet_size <= 0) {
+    return 1;
+  }
+
+  if(frame->key_frame) {
+    self->keyframe_packet_size = packet_size;
+    if(keyframe_packet_size <= 0) {
+      return 1;
+    }
+    return (float)abs(packet_size - keyframe_packet_size) /
+      FFMAX(packet_size, keyframe_packet_size);
+  }
+
+  if(keyframe_packet_size <= 0) {
+    return 1;
+  }
+
+  return FFMIN((float)packet_size / keyframe_packet_size, 1.0f);
+}
+
 /***
 Creates a new Video.
 
+Opening a video normally probes the stream to discover its parameters, which
+can take longer than decoding for short clips. The following options can
+bound or skip that probe:
+
+* `format`: container format name (eg "mpeg"), skipping format detection.
+* `probesize`: maximum number of bytes to read while probing.
+* `analyzeduration`: maximum duration to analyse while probing (in
+  microseconds).
+* `stream_params`: trusted stream parameters as returned by
+  `Video:stream_params`. Probing is skipped for containers whose header
+  describes their streams (eg Matroska or MP4). Containers which only create
+  streams as packets are read (eg MPEG-PS) still need a minimal probe to
+  discover them, which can also read the end of the file to estimate the
+  duration.
+
+Several video streams (eg from a multi-camera recording) can be decoded from a
+single pass over the file by listing their indices:
+
+* `streams`: list of zero-based stream indices. Frames are read with
+  `Video:next_image_frame_set`, and the first stream is used as the timing
+  reference.
+* `sync_tolerance`: maximum difference between the timestamps of matched
+  frames (in seconds). Defaults to half the reference frame period.
+* `sync_lookahead`: how far past a reference frame to read while looking for
+  its matches (in seconds, defaults to 2). Reference frames are skipped if a
+  stream has no frame near them by then, eg because it starts late or stops
+  early. This bounds the number of frames buffered for each stream.
+
+Changes between consecutive decoded frames can be scored as they are read,
+which allows `Video:next_image_frame` to skip static footage:
+
+* `change_detection`: "luma" for the mean absolute difference of
+  downsampled luma, or "packet_size" for the compressed size of each inter
+  frame relative to the latest keyframe (cheaper, but much coarser).
+* `change_detection_step`: luma downsampling factor in each dimension
+  (defaults to 4).
+
 @function Video.new
 @string path Absolute or relative path to a video file.
+@tparam[opt] table options Open options.
 @treturn Video
 */
 static int Video_new(lua_State *L) {
-  if(lua_gettop(L) != 1) {
-    return luaL_error(L, "invalid number of arguments: <path> expected");
+  int n_args = lua_gettop(L);
+  if(n_args < 1 || n_args > 2) {
+    return luaL_error(L, "invalid number of arguments: <path> [options] expected");
   }
 
   const char *path = luaL_checkstring(L, 1);
 
+  const char *format_name = NULL;
+  lua_Integer probesize = 0;
+  lua_Integer analyzeduration = 0;
+  int stream_params_index = 0;
+  int sync_stream_indices[MAX_SYNC_STREAMS];
+  int n_sync_streams = 0;
+  lua_Number sync_tolerance = 0;
+  lua_Number sync_lookahead = 2;
+  const char *change_detection_name = NULL;
+  lua_Integer change_detection_step = 4;
+
+  if(n_args > 1 && !lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    format_name = get_string_field(L, 2, "format", NULL);
+    probesize = get_integer_field(L, 2, "probesize", 0);
+    analyzeduration = get_integer_field(L, 2, "analyzeduration", 0);
+
+    lua_getfield(L, 2, "stream_params");
+    if(lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+    } else {
+      luaL_checktype(L, -1, LUA_TTABLE);
+      stream_params_index = lua_gettop(L);
+    }
+
+    lua_getfield(L, 2, "streams");
+    if(!lua_isnil(L, -1)) {
+      luaL_checktype(L, -1, LUA_TTABLE);
+      n_sync_streams = lua_rawlen(L, -1);
+      if(n_sync_streams < 1 || n_sync_streams > MAX_SYNC_STREAMS) {
+        return luaL_error(L, "streams must list between 1 and %d indices",
+          MAX_SYNC_STREAMS);
+      }
+      int i;
+      for(i = 0; i < n_sync_streams; ++i) {
+        lua_rawgeti(L, -1, i + 1);
+        if(!lua_isnumber(L, -1)) {
+          return luaL_error(L, "streams must contain stream indices");
+        }
+        sync_stream_indices[i] = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 1);
+
+    sync_tolerance = get_number_field(L, 2, "sync_tolerance", 0);
+    sync_lookahead = get_number_field(L, 2, "sync_lookahead", sync_lookahead);
+    if(sync_lookahead <= 0) {
+      return luaL_error(L, "sync_lookahead must be positive");
+    }
+
+    if(n_sync_streams > 0 && stream_params_index) {
+      return luaL_error(L, "streams cannot be combined with stream_params");
+    }
+
+    change_detection_name = get_string_field(L, 2, "change_detection", NULL);
+    change_detection_step = get_integer_field(L, 2, "change_detection_step",
+      change_detection_step);
+  }
+
+  TVChangeDetection change_detection = TVChangeDetection_None;
+  if(change_detection_name) {
+    if(strcmp(change_detection_name, "luma") == 0) {
+      change_detection = TVChangeDetection_Luma;
+    } else if(strcmp(change_detection_name, "packet_size") == 0) {
+      change_detection = TVChangeDetection_PacketSize;
+    } else {
+      return luaL_error(L, "unknown change detection method %s",
+        change_detection_name);
+    }
+    if(change_detection_step < 1) {
+      return luaL_error(L, "change_detection_step must be at least 1");
+    }
+    if(n_sync_streams > 0) {
+      return luaL_error(L, "change_detection cannot be combined with streams");
+    }
+  }
+
+  AVInputFormat *input_format = NULL;
+  if(format_name) {
+    input_format = av_find_input_format(format_name);
+    if(input_format == NULL) {
+      return luaL_error(L, "unknown input format %s", format_name);
+    }
+  }
+
+  AVDictionary *format_options = NULL;
+  if(probesize > 0) {
+    av_dict_set_int(&format_options, "probesize", probesize, 0);
+  }
+  if(analyzeduration > 0) {
+    av_dict_set_int(&format_options, "analyzeduration", analyzeduration, 0);
+  }
+
   Video *self = lua_newuserdata(L, sizeof(Video));
   memset(self, 0, sizeof(Video));
 
-  if(avformat_open_input(&self->format_context, path, NULL, NULL) < 0) {
+  int errnum = avformat_open_input(&self->format_context, path, input_format,
+    &format_options);
+  av_dict_free(&format_options);
+  if(errnum < 0) {
     return luaL_error(L, "failed to open video input for %s", path);
   }
 
-  if(avformat_find_stream_info(self->format_context, NULL) < 0) {
-    return luaL_error(L, "failed to find stream info for %s", path);
-  }
-
   AVCodec *decoder;
-  self->video_stream_index = av_find_best_stream(self->format_context,
-    AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
-  if(self->video_stream_index < 0) {
-    return luaL_error(L, "failed to find video stream for %s", path);
+
+  if(stream_params_index) {
+    const char *error_msg = apply_stream_params(L, stream_params_index, self,
+      &decoder);
+    if(error_msg) {
+      return luaL_error(L, "%s for %s", error_msg, path);
+    }
+  } else {
+    if(avformat_find_stream_info(self->format_context, NULL) < 0) {
+      return luaL_error(L, "failed to find stream info for %s", path);
+    }
+
+    if(n_sync_streams > 0) {
+      self->video_stream_index = check_sync_stream_indices(self->format_context,
+        sync_stream_indices, n_sync_streams);
+      if(self->video_stream_index < 0) {
+        return luaL_error(L, "invalid video stream indices for %s", path);
+      }
+      decoder = avcodec_find_decoder(
+        self->format_context->streams[self->video_stream_index]->codec->codec_id);
+    } else {
+      self->video_stream_index = av_find_best_stream(self->format_context,
+        AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+    }
+    if(self->video_stream_index < 0) {
+      return luaL_error(L, "failed to find video stream for %s", path);
+    }
   }
 
   self->image_decoder_context = self->format_context->streams[self->video_stream_index]->codec;
@@ -252,12 +890,90 @@ static int Video_new(lua_State *L) {
 
   self->seek_pts = AV_NOPTS_VALUE;
 
+  if(n_sync_streams > 0) {
+    if(open_sync_streams(self, sync_stream_indices, n_sync_streams) < 0) {
+      return luaL_error(L, "failed to open video decoder for %s", path);
+    }
+
+    if(sync_tolerance <= 0) {
+      AVRational framerate = av_guess_frame_rate(self->format_context,
+        self->format_context->streams[self->video_stream_index], NULL);
+      sync_tolerance = framerate.num > 0 ? 0.5 / av_q2d(framerate) : 0.02;
+    }
+    self->sync_tolerance = sync_tolerance;
+    self->sync_lookahead = sync_lookahead;
+  }
+
+  if(change_detection == TVChangeDetection_Luma &&
+    !supports_luma_change_detection(self->image_decoder_context->pix_fmt))
+  {
+    return luaL_error(L, "luma change detection is unsupported for the pixel format of %s", path);
+  }
+  self->change_detection = change_detection;
+  self->change_detection_step = change_detection_step;
+
   luaL_getmetatable(L, "Video");
   lua_setmetatable(L, -2);
 
   return 1;
 }
 
+/***
+Get the parameters of the selected video stream.
+
+The returned table can be stored (eg in a manifest built by scanning a
+dataset once) and later passed to `Video.new` as the `stream_params` option
+to skip stream probing.
+
+@function stream_params
+@treturn table Stream index, codec name, pixel format, size, time base and
+  frame rate.
+*/
+static int Video_stream_params(lua_State *L) {
+  Video *self = (Video*)luaL_checkudata(L, 1, "Video");
+  AVCodecContext *codec_context = self->image_decoder_context;
+
+  lua_newtable(L);
+
+  lua_pushinteger(L, self->video_stream_index);
+  lua_setfield(L, -2, "stream_index");
+
+  if(codec_context->codec) {
+    lua_pushstring(L, codec_context->codec->name);
+    lua_setfield(L, -2, "codec");
+  }
+
+  const char *pixel_format_name = av_get_pix_fmt_name(codec_context->pix_fmt);
+  if(pixel_format_name) {
+    lua_pushstring(L, pixel_format_name);
+    lua_setfield(L, -2, "pixel_format");
+  }
+
+  lua_pushinteger(L, codec_context->width);
+  lua_setfield(L, -2, "width");
+
+  lua_pushinteger(L, codec_context->height);
+  lua_setfield(L, -2, "height");
+
+  lua_pushinteger(L, codec_context->time_base.num);
+  lua_setfield(L, -2, "time_base_num");
+
+  lua_pushinteger(L, codec_context->time_base.den);
+  lua_setfield(L, -2, "time_base_den");
+
+  AVRational frame_rate = av_guess_frame_rate(self->format_context,
+    self->format_context->streams[self->video_stream_index], NULL);
+  if(frame_rate.num > 0 && frame_rate.den > 0) {
+    lua_pushinteger(L, frame_rate.num);
+    lua_setfield(L, -2, "frame_rate_num");
+
+    lua_pushinteger(L, frame_rate.den);
+    lua_setfield(L, -2, "frame_rate_den");
+  }
+
+  return 1;
+}
+
 /***
 Get the duration of the video in seconds.
 
@@ -289,7 +1005,11 @@ static int Video_guess_image_frame_rate(lua_State *L) {
     self->format_context->streams[self->video_stream_index],
     NULL);
 
-  lua_pushnumber(L, (lua_Number)framerate.num / framerate.den);
+  if(framerate.num > 0 && framerate.den > 0) {
+    lua_pushnumber(L, (lua_Number)framerate.num / framerate.den);
+  } else {
+    lua_pushnumber(L, 0);
+  }
 
   return 1;
 }
@@ -311,31 +1031,12 @@ static int Video_get_image_frame_count(lua_State *L) {
   return 1;
 }
 
-/***
-Apply a filterchain to the video.
-
-@function filter
-@string pixel_format_name The desired output pixel format.
-@string[opt='null'] filterchain A description of the filterchain.
-@treturn number The duration of the video in seconds.
-*/
-static int Video_filter(lua_State *L) {
-  int n_args = lua_gettop(L);
-
-  Video *self = (Video*)luaL_checkudata(L, 1, "Video");
-  const char *pixel_format_name = luaL_checkstring(L, 2);
-  const char *filterchain;
-  if(n_args < 3) {
-    filterchain = "null";
-  } else {
-    filterchain = luaL_checkstring(L, 3);
-  }
-
-  if(self->filter_graph) {
-    return luaL_error(L, "filter already set for this video");
-  }
-
-  const char* error_msg = 0;
+static const char* create_filter_graph(AVCodecContext *decoder_context,
+  const char *pixel_format_name, const char *filterchain,
+  AVFilterGraph **filter_graph_out, AVFilterContext **buffersrc_context_out,
+  AVFilterContext **buffersink_context_out)
+{
+  const char* error_msg = 0;
 
   AVFilter *buffersrc = avfilter_get_by_name("buffer");
   AVFilter *buffersink = avfilter_get_by_name("buffersink");
@@ -346,13 +1047,13 @@ static int Video_filter(lua_State *L) {
   char in_args[512];
   snprintf(in_args, sizeof(in_args),
     "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-    self->image_decoder_context->width,
-    self->image_decoder_context->height,
-    self->image_decoder_context->pix_fmt,
-    self->image_decoder_context->time_base.num,
-    self->image_decoder_context->time_base.den,
-    self->image_decoder_context->sample_aspect_ratio.num,
-    self->image_decoder_context->sample_aspect_ratio.den);
+    decoder_context->width,
+    decoder_context->height,
+    decoder_context->pix_fmt,
+    decoder_context->time_base.num,
+    decoder_context->time_base.den,
+    decoder_context->sample_aspect_ratio.num,
+    decoder_context->sample_aspect_ratio.den);
 
   AVFilterContext *buffersrc_context;
   AVFilterContext *buffersink_context;
@@ -406,6 +1107,84 @@ static int Video_filter(lua_State *L) {
     goto end;
   }
 
+  *filter_graph_out = filter_graph;
+  *buffersrc_context_out = buffersrc_context;
+  *buffersink_context_out = buffersink_context;
+
+end:
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+
+  if(error_msg) {
+    avfilter_graph_free(&filter_graph);
+  }
+
+  return error_msg;
+}
+
+/***
+Apply a filterchain to the video.
+
+@function filter
+@string pixel_format_name The desired output pixel format.
+@string[opt='null'] filterchain A description of the filterchain.
+@treturn number The duration of the video in seconds.
+*/
+static int Video_filter(lua_State *L) {
+  int n_args = lua_gettop(L);
+
+  Video *self = (Video*)luaL_checkudata(L, 1, "Video");
+  const char *pixel_format_name = luaL_checkstring(L, 2);
+  const char *filterchain;
+  if(n_args < 3) {
+    filterchain = "null";
+  } else {
+    filterchain = luaL_checkstring(L, 3);
+  }
+
+  if(self->filter_graph ||
+    (self->n_sync_streams > 0 && self->sync_streams[0].filter_graph))
+  {
+    return luaL_error(L, "filter already set for this video");
+  }
+
+  if(self->n_sync_streams > 0) {
+    // Filter each stream in the same way
+    int i;
+    for(i = 0; i < self->n_sync_streams; ++i) {
+      SyncStream *stream = &self->sync_streams[i];
+      const char *error_msg = create_filter_graph(stream->decoder_context,
+        pixel_format_name, filterchain, &stream->filter_graph,
+        &stream->buffersrc_context, &stream->buffersink_context);
+      if(error_msg) {
+        while(i-- > 0) {
+          avfilter_graph_free(&self->sync_streams[i].filter_graph);
+        }
+        return luaL_error(L, error_msg);
+      }
+      stream->filtered_frame = av_frame_alloc();
+    }
+
+    Video *filtered_video = lua_newuserdata(L, sizeof(Video));
+    *filtered_video = *self;
+    self->skip_destroy = 1;
+
+    luaL_getmetatable(L, "Video");
+    lua_setmetatable(L, -2);
+
+    return 1;
+  }
+
+  AVFilterGraph *filter_graph;
+  AVFilterContext *buffersrc_context;
+  AVFilterContext *buffersink_context;
+
+  const char *error_msg = create_filter_graph(self->image_decoder_context,
+    pixel_format_name, filterchain,
+    &filter_graph, &buffersrc_context, &buffersink_context);
+
+  if(error_msg) return luaL_error(L, error_msg);
+
   // Copy self
   Video *filtered_video = lua_newuserdata(L, sizeof(Video));
   *filtered_video = *self;
@@ -419,122 +1198,192 @@ static int Video_filter(lua_State *L) {
   luaL_getmetatable(L, "Video");
   lua_setmetatable(L, -2);
 
-end:
-  avfilter_inout_free(&inputs);
-  avfilter_inout_free(&outputs);
-
-  if(error_msg) return luaL_error(L, error_msg);
-
   return 1;
 }
 
-static TVError read_image_frame(Video *self, ImageFrame *video_frame, int decode_only, int filter_only) {
-  if(self->filter_graph && av_buffersink_get_frame(self->buffersink_context,
-    self->filtered_frame) >= 0)
-  {
-    video_frame->frame = self->filtered_frame;
-  } else {
-    int found_video_frame;
+// Change scores travel through the filtergraph as frame metadata, so that each
+// filtered frame reports the score of the decoded frame it was made from, even
+// when the graph buffers or drops frames
+#define CHANGE_SCORE_METADATA_KEY "torchvid.change_score"
+
+static void set_frame_change_score(AVFrame *frame, float change_score) {
+  char value[32];
+  snprintf(value, sizeof(value), "%.9g", change_score);
+  AVDictionary *metadata = av_frame_get_metadata(frame);
+  av_dict_set(&metadata, CHANGE_SCORE_METADATA_KEY, value, 0);
+  av_frame_set_metadata(frame, metadata);
+}
+
+static float get_frame_change_score(AVFrame *frame) {
+  AVDictionaryEntry *entry = av_dict_get(av_frame_get_metadata(frame),
+    CHANGE_SCORE_METADATA_KEY, NULL, 0);
+  return entry ? strtof(entry->value, NULL) : NAN;
+}
 
-    if(filter_only) {
-      goto start_filter_video_frame;
+// Pulls the next filtered frame whose change score meets min_change. Returns
+// zero if the filtergraph needs more input.
+static int pull_filtered_frame(Video *self, ImageFrame *video_frame,
+  float min_change)
+{
+  for(;;) {
+    av_frame_unref(self->filtered_frame);
+    if(av_buffersink_get_frame(self->buffersink_context, self->filtered_frame) < 0) {
+      return 0;
     }
 
-start_read_video_frame:
-    found_video_frame = 0;
+    float change_score = get_frame_change_score(self->filtered_frame);
+    if(min_change <= 0 || change_score >= min_change) {
+      video_frame->frame = self->filtered_frame;
+      video_frame->change_score = change_score;
+      return 1;
+    }
+  }
+}
 
-    while(!found_video_frame) {
-      // Clear the packet
-      av_packet_unref(&self->packet);
+// Decodes the next frame of the video stream into self->frame.
+static TVError decode_image_frame(Video *self) {
+  int found_video_frame = 0;
 
-      int errnum = av_read_frame(self->format_context, &self->packet);
-      if(errnum == AVERROR(EAGAIN)) {
-        continue;
-      } else if(errnum == AVERROR_EOF) {
-        // We've exhausted av_read_frame, it's time to milk
-        // avcodec_decode_video2
-        av_frame_unref(self->frame);
-
-        if(avcodec_decode_video2(self->image_decoder_context, self->frame,
-          &found_video_frame, &self->packet) < 0)
-        {
-          return TVError_DecodeFail;
-        }
+  while(!found_video_frame) {
+    // Clear the packet
+    av_packet_unref(&self->packet);
 
-        if(!found_video_frame) {
-          return TVError_EOF;
-        }
+    int errnum = av_read_frame(self->format_context, &self->packet);
+    if(errnum == AVERROR(EAGAIN)) {
+      continue;
+    } else if(errnum == AVERROR_EOF) {
+      // We've exhausted av_read_frame, it's time to milk
+      // avcodec_decode_video2
+      av_frame_unref(self->frame);
 
-        break;
-      } else if(errnum != 0) {
-        return TVError_ReadFail;
+      if(avcodec_decode_video2(self->image_decoder_context, self->frame,
+        &found_video_frame, &self->packet) < 0)
+      {
+        return TVError_DecodeFail;
       }
 
-      if(self->packet.stream_index == self->video_stream_index) {
-        av_frame_unref(self->frame);
-
-        if(avcodec_decode_video2(self->image_decoder_context, self->frame,
-          &found_video_frame, &self->packet) < 0)
-        {
-          return TVError_DecodeFail;
-        }
+      if(!found_video_frame) {
+        return TVError_EOF;
       }
+
+      break;
+    } else if(errnum != 0) {
+      return TVError_ReadFail;
     }
 
-start_filter_video_frame:
-    if(!decode_only && self->filter_graph) {
-      // Push the decoded frame into the filtergraph
-      if(av_buffersrc_add_frame_flags(self->buffersrc_context,
-        self->frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+    if(self->packet.stream_index == self->video_stream_index) {
+      av_frame_unref(self->frame);
+
+      if(avcodec_decode_video2(self->image_decoder_context, self->frame,
+        &found_video_frame, &self->packet) < 0)
       {
-        return TVError_FilterFail;
+        return TVError_DecodeFail;
       }
+    }
+  }
 
-      // Pull filtered frames from the filtergraph
-      av_frame_unref(self->filtered_frame);
-      if(av_buffersink_get_frame(self->buffersink_context, self->filtered_frame) < 0) {
-        goto start_read_video_frame;
+  switch(self->change_detection) {
+    case TVChangeDetection_None:
+      self->change_score = NAN;
+      break;
+    case TVChangeDetection_Luma:
+      self->change_score = luma_change_score(self, self->frame);
+      break;
+    case TVChangeDetection_PacketSize:
+      self->change_score = packet_size_change_score(self, self->frame);
+      break;
+  }
+
+  return TVError_None;
+}
+
+// Reads the next frame, skipping decoded frames before a pending fine-grained
+// seek or which changed less than min_change, without filtering them.
+static TVError read_image_frame(Video *self, ImageFrame *video_frame,
+  float min_change)
+{
+  // Frames left in the filtergraph by the previous read come first
+  if(self->filter_graph && pull_filtered_frame(self, video_frame, min_change)) {
+    return TVError_None;
+  }
+
+  for(;;) {
+    TVError err = decode_image_frame(self);
+    if(err != TVError_None) {
+      return err;
+    }
+
+    if(self->seek_pts != AV_NOPTS_VALUE) {
+      // Do fine-grained seek
+      int64_t pts = av_frame_get_best_effort_timestamp(self->frame);
+      if(pts == AV_NOPTS_VALUE || pts < self->seek_pts) {
+        continue;
       }
-      video_frame->frame = self->filtered_frame;
-    } else {
+      self->seek_pts = AV_NOPTS_VALUE;
+    }
+
+    if(min_change > 0 && !(self->change_score >= min_change)) {
+      continue;
+    }
+
+    if(!self->filter_graph) {
       video_frame->frame = self->frame;
+      video_frame->change_score = self->change_score;
+      return TVError_None;
     }
-  }
 
-  return TVError_None;
+    // Push the decoded frame into the filtergraph
+    if(self->change_detection) {
+      set_frame_change_score(self->frame, self->change_score);
+    }
+    if(av_buffersrc_add_frame_flags(self->buffersrc_context,
+      self->frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+    {
+      return TVError_FilterFail;
+    }
+
+    // Pull filtered frames from the filtergraph
+    if(pull_filtered_frame(self, video_frame, min_change)) {
+      return TVError_None;
+    }
+  }
 }
 
 /***
 Read the next video frame from the video.
 
+If the video was opened with the `change_detection` option, frames which
+differ from the previous decoded frame by less than `min_change` are skipped
+without being filtered. Filtered frames report the change score of the decoded
+frame they were made from, so this also holds for filterchains which buffer or
+drop frames.
+
 @function next_image_frame
+@tparam[opt] table options Table which may contain `min_change`, a change
+  score threshold between 0 and 1.
 @treturn ImageFrame
 */
 static int Video_next_image_frame(lua_State *L) {
   Video *self = (Video*)luaL_checkudata(L, 1, "Video");
 
-  ImageFrame *video_frame = lua_newuserdata(L, sizeof(ImageFrame));
+  if(self->n_sync_streams > 0) {
+    return luaL_error(L, "use next_image_frame_set for videos opened with multiple streams");
+  }
 
-  TVError err;
+  lua_Number min_change = 0;
+  if(!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    min_change = get_number_field(L, 2, "min_change", 0);
+  }
 
-  if(self->seek_pts != AV_NOPTS_VALUE) {
-    // Do fine-grained seek
-    err = read_image_frame(self, video_frame, 1, 0);
-    while(err == TVError_None) {
-      int64_t pts = av_frame_get_best_effort_timestamp(video_frame->frame);
-      if(pts != AV_NOPTS_VALUE && pts >= self->seek_pts) {
-        break;
-      }
-      err = read_image_frame(self, video_frame, 1, 0);
-    }
-    self->seek_pts = AV_NOPTS_VALUE;
-    if(err == TVError_None) {
-      err = read_image_frame(self, video_frame, 0, 1);
-    }
-  } else {
-    err = read_image_frame(self, video_frame, 0, 0);
+  if(min_change > 0 && !self->change_detection) {
+    return luaL_error(L, "min_change requires the change_detection option");
   }
 
+  ImageFrame *video_frame = lua_newuserdata(L, sizeof(ImageFrame));
+
+  TVError err = read_image_frame(self, video_frame, min_change);
+
   switch(err) {
     case TVError_EOF:
       return luaL_error(L, "reached end of video");
@@ -544,10 +1393,15 @@ static int Video_next_image_frame(lua_State *L) {
       return luaL_error(L, "couldn't decode video frame");
     case TVError_FilterFail:
       return luaL_error(L, "error while feeding the filtergraph");
+    case TVError_SeekFail:
+      return luaL_error(L, "error while seeking");
   }
 
   float time_base = av_q2d(self->format_context->streams[self->video_stream_index]->time_base);
   video_frame->timestamp = av_frame_get_best_effort_timestamp(video_frame->frame) * time_base;
+  if(!self->change_detection) {
+    video_frame->change_score = NAN;
+  }
 
   luaL_getmetatable(L, "ImageFrame");
   lua_setmetatable(L, -2);
@@ -555,105 +1409,2004 @@ static int Video_next_image_frame(lua_State *L) {
   return 1;
 }
 
-/***
-Seek to the first keyframe before the frame number specified.
+static void pop_sync_frame(SyncStream *stream) {
+  av_frame_free(&stream->queue[0]);
+  memmove(stream->queue, stream->queue + 1,
+    (stream->queue_length - 1) * sizeof(AVFrame*));
+  --stream->queue_length;
+}
 
-@function seek
-@number seek_target The position to seek to (in seconds).
-@treturn Video This video object.
-*/
-static int Video_seek(lua_State *L) {
-  Video *self = (Video*)luaL_checkudata(L, 1, "Video");
-  lua_Number seek_target = luaL_checknumber(L, 2);
+static float sync_frame_timestamp(SyncStream *stream, AVFrame *frame) {
+  return av_frame_get_best_effort_timestamp(frame) * av_q2d(stream->time_base);
+}
 
-  float time_base = av_q2d(self->format_context->streams[self->video_stream_index]->time_base);
-  int64_t timestamp = (int64_t)floor(seek_target / time_base);
+// Checks whether some stream is known to have no frame within the sync
+// tolerance of a reference frame, because it starts later or has ended
+// earlier.
+static int is_unmatchable_sync_timestamp(Video *self, float timestamp) {
+  int i;
+  for(i = 1; i < self->n_sync_streams; ++i) {
+    SyncStream *stream = &self->sync_streams[i];
+    if(timestamp < stream->first_timestamp - self->sync_tolerance) {
+      return 1;
+    }
+    if(stream->eof && stream->queue_length == 0) {
+      return 1;
+    }
+    if(stream->eof &&
+      timestamp > stream->last_timestamp + self->sync_tolerance)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
 
-  // Do course seek to keyframe
-  if(av_seek_frame(self->format_context, self->video_stream_index, timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
-    return luaL_error(L, "error while seeking");
-  } else {
-    avcodec_flush_buffers(self->image_decoder_context);
+// Earliest timestamp that a future reference frame may have. Frames of other
+// streams which are superseded as the nearest match for it can be discarded.
+static float sync_lower_bound(Video *self) {
+  SyncStream *reference = &self->sync_streams[0];
+  if(isnan(reference->first_timestamp)) {
+    // Nothing of the reference stream has been demuxed yet, so rely on
+    // it being interleaved within the lookahead of the other streams
+    return self->demux_timestamp - self->sync_lookahead;
   }
+  return FFMAX(self->sync_timestamp, reference->first_timestamp);
+}
 
-  // Set seek_pts so fine-grained seek can happen when the next frame is read
-  self->seek_pts = timestamp;
+static void push_sync_frame(Video *self, SyncStream *stream, AVFrame *frame) {
+  float timestamp = sync_frame_timestamp(stream, frame);
+  stream->last_timestamp = timestamp;
 
-  lua_pop(L, 1);
+  // Reference frames which can't be matched are dropped rather than queued
+  if(stream == &self->sync_streams[0] &&
+    is_unmatchable_sync_timestamp(self, timestamp))
+  {
+    av_frame_free(&frame);
+    return;
+  }
 
-  return 1;
+  if(stream->queue_length == stream->queue_capacity) {
+    stream->queue_capacity = stream->queue_capacity > 0 ?
+      stream->queue_capacity * 2 : 16;
+    stream->queue = av_realloc_array(stream->queue, stream->queue_capacity,
+      sizeof(AVFrame*));
+  }
+
+  stream->queue[stream->queue_length++] = frame;
+
+  if(stream != &self->sync_streams[0]) {
+    float lower_bound = sync_lower_bound(self);
+    while(stream->queue_length >= 2 &&
+      sync_frame_timestamp(stream, stream->queue[1]) <= lower_bound)
+    {
+      pop_sync_frame(stream);
+    }
+  }
 }
 
-static int Video_destroy(lua_State *L) {
-  Video *self = (Video*)luaL_checkudata(L, 1, "Video");
+static TVError queue_sync_frame(Video *self, SyncStream *stream) {
+  if(!stream->filter_graph) {
+    push_sync_frame(self, stream, av_frame_clone(stream->frame));
+    return TVError_None;
+  }
 
-  if(!self->skip_destroy) {
-    avcodec_close(self->image_decoder_context);
-    avformat_close_input(&self->format_context);
+  if(av_buffersrc_add_frame_flags(stream->buffersrc_context, stream->frame,
+    AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+  {
+    return TVError_FilterFail;
+  }
 
-    av_packet_unref(&self->packet);
+  while(av_buffersink_get_frame(stream->buffersink_context,
+    stream->filtered_frame) >= 0)
+  {
+    AVFrame *frame = av_frame_alloc();
+    av_frame_move_ref(frame, stream->filtered_frame);
+    push_sync_frame(self, stream, frame);
+  }
 
-    if(self->frame != NULL) {
-      av_frame_unref(self->frame);
-      av_frame_free(&self->frame);
-    }
+  return TVError_None;
+}
 
-    if(self->filter_graph) {
-      avfilter_graph_free(&self->filter_graph);
+static TVError decode_sync_packet(Video *self, SyncStream *stream,
+  AVPacket *packet, int *found_video_frame)
+{
+  av_frame_unref(stream->frame);
+
+  if(avcodec_decode_video2(stream->decoder_context, stream->frame,
+    found_video_frame, packet) < 0)
+  {
+    return TVError_DecodeFail;
+  }
+
+  if(*found_video_frame) {
+    return queue_sync_frame(self, stream);
+  }
+
+  return TVError_None;
+}
+
+// Demuxes one packet and decodes it with the stream it belongs to. At the end
+// of the file, frames buffered in the decoders are flushed out.
+static TVError read_sync_packet(Video *self) {
+  int i;
+
+  av_packet_unref(&self->packet);
+
+  int errnum = av_read_frame(self->format_context, &self->packet);
+  if(errnum == AVERROR(EAGAIN)) {
+    return TVError_None;
+  } else if(errnum == AVERROR_EOF) {
+    for(i = 0; i < self->n_sync_streams; ++i) {
+      SyncStream *stream = &self->sync_streams[i];
+      int found_video_frame = 1;
+      while(!stream->eof && found_video_frame) {
+        TVError err = decode_sync_packet(self, stream, &self->packet,
+          &found_video_frame);
+        if(err != TVError_None) return err;
+      }
+      stream->eof = 1;
     }
+    return TVError_None;
+  } else if(errnum != 0) {
+    return TVError_ReadFail;
+  }
 
-    if(self->filtered_frame != NULL) {
-      av_frame_unref(self->filtered_frame);
-      av_frame_free(&self->filtered_frame);
+  for(i = 0; i < self->n_sync_streams; ++i) {
+    SyncStream *stream = &self->sync_streams[i];
+    if(self->packet.stream_index == stream->stream_index) {
+      // Track how far demuxing has got from packet timestamps, which are
+      // known before the packets are decoded
+      int64_t pts = self->packet.pts != AV_NOPTS_VALUE ?
+        self->packet.pts : self->packet.dts;
+      if(pts != AV_NOPTS_VALUE) {
+        float packet_timestamp = pts * av_q2d(stream->time_base);
+        if(isnan(stream->first_timestamp)) {
+          stream->first_timestamp = packet_timestamp;
+        }
+        self->demux_timestamp = FFMAX(self->demux_timestamp, packet_timestamp);
+      }
+
+      int found_video_frame;
+      return decode_sync_packet(self, stream, &self->packet,
+        &found_video_frame);
     }
   }
 
-  return 0;
+  return TVError_None;
 }
 
-static const luaL_Reg Video_functions[] = {
-  {"new", Video_new},
-  {NULL, NULL}
-};
+// Finds the frame of a stream nearest to the given timestamp, discarding
+// earlier frames which can no longer be the nearest match for any later
+// reference frame. Reading stops once demuxing is more than the sync lookahead
+// past the timestamp. The match is returned as a new reference, since reading
+// further packets may reallocate the queue.
+static TVError match_sync_frame(Video *self, SyncStream *stream,
+  float timestamp, AVFrame **match)
+{
+  while(!stream->eof && (stream->queue_length == 0 ||
+    sync_frame_timestamp(stream, stream->queue[stream->queue_length - 1]) < timestamp) &&
+    self->demux_timestamp <= timestamp + self->sync_lookahead)
+  {
+    TVError err = read_sync_packet(self);
+    if(err != TVError_None) return err;
+  }
 
-static const luaL_Reg Video_methods[] = {
-  {"duration", Video_duration},
-  {"guess_image_frame_rate", Video_guess_image_frame_rate},
-  {"get_image_frame_count", Video_get_image_frame_count},
-  {"filter", Video_filter},
-  {"next_image_frame", Video_next_image_frame},
-  {"seek", Video_seek},
-  {"__gc", Video_destroy},
-  {NULL, NULL}
-};
+  while(stream->queue_length >= 2 &&
+    fabs(sync_frame_timestamp(stream, stream->queue[1]) - timestamp) <=
+    fabs(sync_frame_timestamp(stream, stream->queue[0]) - timestamp))
+  {
+    pop_sync_frame(stream);
+  }
 
-static void register_Video(lua_State *L, int m) {
-  luaL_newmetatable(L, "Video");
-  lua_pushvalue(L, -1);
-  lua_setfield(L, -2, "__index");
+  *match = NULL;
+  if(stream->queue_length > 0 &&
+    fabs(sync_frame_timestamp(stream, stream->queue[0]) - timestamp) <= self->sync_tolerance)
+  {
+    *match = av_frame_clone(stream->queue[0]);
+  }
 
-  luaL_setfuncs(L, Video_methods, 0);
-  lua_pop(L, 1);
+  return TVError_None;
+}
 
-  luaL_newlib(L, Video_functions);
+static TVError read_image_frame_set(Video *self) {
+  SyncStream *reference = &self->sync_streams[0];
+  int i;
 
-  lua_setfield(L, m, "Video");
-}
+  for(;;) {
+    while(reference->queue_length == 0 && !reference->eof) {
+      TVError err = read_sync_packet(self);
+      if(err != TVError_None) return err;
+    }
 
-int luaopen_torchvid(lua_State *L) {
-  // Initialization
-  av_log_set_level(AV_LOG_ERROR);
-  avcodec_register_all();
-  av_register_all();
-  avfilter_register_all();
+    if(reference->queue_length == 0) {
+      return TVError_EOF;
+    }
 
-  // Create table for module
-  lua_newtable(L);
-  int m = lua_gettop(L);
+    // Each reference frame is used at most once, but frames of other streams
+    // may be matched again if they remain the nearest
+    AVFrame *matches[MAX_SYNC_STREAMS] = {NULL};
+    matches[0] = reference->queue[0];
+    memmove(reference->queue, reference->queue + 1,
+      (reference->queue_length - 1) * sizeof(AVFrame*));
+    --reference->queue_length;
+
+    if(self->seek_pts != AV_NOPTS_VALUE) {
+      // Do fine-grained seek
+      int64_t pts = av_frame_get_best_effort_timestamp(matches[0]);
+      if(pts == AV_NOPTS_VALUE || pts < self->seek_pts) {
+        av_frame_free(&matches[0]);
+        continue;
+      }
+      self->seek_pts = AV_NOPTS_VALUE;
+    }
 
-  // Add values for classes
-  register_Video(L, m);
-  register_ImageFrame(L, m);
+    float timestamp = sync_frame_timestamp(reference, matches[0]);
+    self->sync_timestamp = timestamp;
+
+    if(is_unmatchable_sync_timestamp(self, timestamp)) {
+      av_frame_free(&matches[0]);
+      continue;
+    }
+
+    TVError err = TVError_None;
+    int matched = 1;
+
+    for(i = 1; i < self->n_sync_streams && err == TVError_None; ++i) {
+      err = match_sync_frame(self, &self->sync_streams[i], timestamp,
+        &matches[i]);
+      if(matches[i] == NULL) matched = 0;
+    }
+
+    for(i = 0; i < self->n_sync_streams; ++i) {
+      SyncStream *stream = &self->sync_streams[i];
+      if(err == TVError_None && matched) {
+        av_frame_unref(stream->current);
+        av_frame_move_ref(stream->current, matches[i]);
+        stream->current_timestamp = sync_frame_timestamp(stream, stream->current);
+      }
+      av_frame_free(&matches[i]);
+    }
+
+    if(err != TVError_None || matched) {
+      return err;
+    }
+  }
+}
+
+static void reset_sync_streams(Video *self) {
+  int i;
+  for(i = 0; i < self->n_sync_streams; ++i) {
+    SyncStream *stream = &self->sync_streams[i];
+    if(i > 0) {
+      avcodec_flush_buffers(stream->decoder_context);
+    }
+    while(stream->queue_length > 0) {
+      pop_sync_frame(stream);
+    }
+    stream->last_timestamp = NAN;
+    stream->eof = 0;
+  }
+  self->demux_timestamp = -INFINITY;
+  self->sync_timestamp = -INFINITY;
+}
+
+/***
+Read the next set of time-aligned frames from a video opened with the
+`streams` option.
+
+Each frame of the first stream is matched with the frame of each other stream
+which is nearest in time. Reference frames without a match within the sync
+tolerance in every stream are skipped.
+
+@function next_image_frame_set
+@treturn ImageFrameSet
+*/
+static int Video_next_image_frame_set(lua_State *L) {
+  Video *self = (Video*)luaL_checkudata(L, 1, "Video");
+
+  if(self->n_sync_streams == 0) {
+    return luaL_error(L, "video was not opened with multiple streams");
+  }
+
+  TVError err = read_image_frame_set(self);
+
+  switch(err) {
+    case TVError_None:
+      break;
+    case TVError_EOF:
+      return luaL_error(L, "reached end of video");
+    case TVError_ReadFail:
+      return luaL_error(L, "couldn't read next frame");
+    case TVError_DecodeFail:
+      return luaL_error(L, "couldn't decode video frame");
+    case TVError_FilterFail:
+      return luaL_error(L, "error while feeding the filtergraph");
+    case TVError_SeekFail:
+      return luaL_error(L, "error while seeking");
+  }
+
+  ImageFrameSet *frame_set = lua_newuserdata(L, sizeof(ImageFrameSet));
+  frame_set->streams = self->sync_streams;
+  frame_set->n_streams = self->n_sync_streams;
+
+  luaL_getmetatable(L, "ImageFrameSet");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+/***
+Seek to the first keyframe before the frame number specified.
+
+@function seek
+@number seek_target The position to seek to (in seconds).
+@treturn Video This video object.
+*/
+static int Video_seek(lua_State *L) {
+  Video *self = (Video*)luaL_checkudata(L, 1, "Video");
+  lua_Number seek_target = luaL_checknumber(L, 2);
+
+  float time_base = av_q2d(self->format_context->streams[self->video_stream_index]->time_base);
+  int64_t timestamp = (int64_t)floor(seek_target / time_base);
+
+  // Do course seek to keyframe
+  if(av_seek_frame(self->format_context, self->video_stream_index, timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+    return luaL_error(L, "error while seeking");
+  } else {
+    avcodec_flush_buffers(self->image_decoder_context);
+    reset_sync_streams(self);
+    // Discard filtered frames from before the seek
+    while(self->filter_graph && av_buffersink_get_frame(
+      self->buffersink_context, self->filtered_frame) >= 0)
+    {
+      av_frame_unref(self->filtered_frame);
+    }
+    self->has_previous_luma = 0;
+    self->keyframe_packet_size = 0;
+  }
+
+  // Set seek_pts so fine-grained seek can happen when the next frame is read
+  self->seek_pts = timestamp;
+
+  lua_pop(L, 1);
+
+  return 1;
+}
+
+static int Video_destroy(lua_State *L) {
+  Video *self = (Video*)luaL_checkudata(L, 1, "Video");
+
+  if(!self->skip_destroy) {
+    int i;
+    for(i = 0; i < self->n_sync_streams; ++i) {
+      SyncStream *stream = &self->sync_streams[i];
+
+      // The first stream shares the reference decoder, closed below
+      if(i > 0 && stream->decoder_context) {
+        avcodec_close(stream->decoder_context);
+      }
+
+      if(stream->queue) {
+        while(stream->queue_length > 0) {
+          pop_sync_frame(stream);
+        }
+        av_free(stream->queue);
+      }
+
+      av_frame_free(&stream->frame);
+      av_frame_free(&stream->current);
+
+      if(stream->filter_graph) {
+        avfilter_graph_free(&stream->filter_graph);
+      }
+
+      av_frame_free(&stream->filtered_frame);
+    }
+    av_free(self->sync_streams);
+
+    avcodec_close(self->image_decoder_context);
+    avformat_close_input(&self->format_context);
+
+    av_packet_unref(&self->packet);
+
+    if(self->frame != NULL) {
+      av_frame_unref(self->frame);
+      av_frame_free(&self->frame);
+    }
+
+    if(self->filter_graph) {
+      avfilter_graph_free(&self->filter_graph);
+    }
+
+    if(self->filtered_frame != NULL) {
+      av_frame_unref(self->filtered_frame);
+      av_frame_free(&self->filtered_frame);
+    }
+
+    av_free(self->luma);
+    av_free(self->previous_luma);
+  }
+
+  return 0;
+}
+
+static const luaL_Reg Video_functions[] = {
+  {"new", Video_new},
+  {NULL, NULL}
+};
+
+static const luaL_Reg Video_methods[] = {
+  {"duration", Video_duration},
+  {"guess_image_frame_rate", Video_guess_image_frame_rate},
+  {"get_image_frame_count", Video_get_image_frame_count},
+  {"stream_params", Video_stream_params},
+  {"filter", Video_filter},
+  {"next_image_frame", Video_next_image_frame},
+  {"next_image_frame_set", Video_next_image_frame_set},
+  {"seek", Video_seek},
+  {"__gc", Video_destroy},
+  {NULL, NULL}
+};
+
+static void register_Video(lua_State *L, int m) {
+  luaL_newmetatable(L, "Video");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  luaL_setfuncs(L, Video_methods, 0);
+  lua_pop(L, 1);
+
+  luaL_newlib(L, Video_functions);
+
+  lua_setfield(L, m, "Video");
+}
+
+/***
+@type ImageFrameSet
+*/
+
+// Checks that every frame in the set can be packed into the same tensor shape
+static void check_frame_set(lua_State *L, ImageFrameSet *self) {
+  AVFrame *first = self->streams[0].current;
+  int i;
+  for(i = 1; i < self->n_streams; ++i) {
+    AVFrame *frame = self->streams[i].current;
+    if(frame->width != first->width || frame->height != first->height ||
+      frame->format != first->format)
+    {
+      luaL_error(L, "frames differ in size or pixel format, apply a filter to make them match");
+    }
+  }
+}
+
+/***
+Copies the pixel data of all frames into a `torch.ByteTensor`.
+
+Accepts the same optional crop region as `ImageFrame:to_byte_tensor`.
+
+@function to_byte_tensor
+@tparam[opt] table region Crop region and spatial stride.
+@treturn torch.ByteTensor A tensor of size S x C x H x W, where S is the
+  number of streams.
+*/
+static int ImageFrameSet_to_byte_tensor(lua_State *L) {
+  ImageFrameSet *self = (ImageFrameSet*)luaL_checkudata(L, 1, "ImageFrameSet");
+  AVFrame *first = self->streams[0].current;
+
+  check_frame_set(L, self);
+
+  PackRegion region;
+  check_pack_region(L, 2, first, &region);
+
+  int n_channels = calculate_tensor_channels(first);
+  int height = region_output_size(region.height, region.stride);
+  int width = region_output_size(region.width, region.stride);
+  THByteTensor *tensor = THByteTensor_newWithSize4d(self->n_streams,
+    n_channels, height, width);
+
+  int i;
+  for(i = 0; i < self->n_streams; ++i) {
+    byte *dest = tensor->storage->data + (size_t)i * n_channels * height * width;
+    if(pack_any_as_byte(dest, self->streams[i].current, &region) < 0) {
+      THByteTensor_free(tensor);
+      return luaL_error(L, "unsupported pixel format");
+    }
+  }
+
+  luaT_pushudata(L, tensor, "torch.ByteTensor");
+
+  return 1;
+}
+
+/***
+Copies the pixel data of all frames into a `torch.FloatTensor`.
+
+Values are scaled as for `ImageFrame:to_float_tensor`, and the same optional
+crop region is accepted.
+
+@function to_float_tensor
+@tparam[opt] table region Crop region and spatial stride.
+@treturn torch.FloatTensor A tensor of size S x C x H x W, where S is the
+  number of streams.
+*/
+static int ImageFrameSet_to_float_tensor(lua_State *L) {
+  ImageFrameSet *self = (ImageFrameSet*)luaL_checkudata(L, 1, "ImageFrameSet");
+  AVFrame *first = self->streams[0].current;
+
+  check_frame_set(L, self);
+
+  PackRegion region;
+  check_pack_region(L, 2, first, &region);
+
+  int n_channels = calculate_tensor_channels(first);
+  int height = region_output_size(region.height, region.stride);
+  int width = region_output_size(region.width, region.stride);
+  THFloatTensor *tensor = THFloatTensor_newWithSize4d(self->n_streams,
+    n_channels, height, width);
+
+  int i;
+  for(i = 0; i < self->n_streams; ++i) {
+    float *dest = tensor->storage->data + (size_t)i * n_channels * height * width;
+    if(pack_any_as_float(dest, self->streams[i].current, &region) < 0) {
+      THFloatTensor_free(tensor);
+      return luaL_error(L, "unsupported pixel format");
+    }
+
+    THFloatTensor *tensor_frame = THFloatTensor_newSelect(tensor, 0, i);
+    normalize_float_tensor(tensor_frame, self->streams[i].current);
+    THFloatTensor_free(tensor_frame);
+  }
+
+  luaT_pushudata(L, tensor, "torch.FloatTensor");
+
+  return 1;
+}
+
+/***
+Get the timestamp of the reference frame in this set (in seconds).
+
+@function timestamp
+@treturn number The timestamp (in seconds).
+*/
+static int ImageFrameSet_timestamp(lua_State *L) {
+  ImageFrameSet *self = (ImageFrameSet*)luaL_checkudata(L, 1, "ImageFrameSet");
+
+  lua_pushnumber(L, self->streams[0].current_timestamp);
+
+  return 1;
+}
+
+/***
+Get the timestamps of every frame in this set (in seconds).
+
+@function timestamps
+@treturn table The timestamps, in the order the streams were selected.
+*/
+static int ImageFrameSet_timestamps(lua_State *L) {
+  ImageFrameSet *self = (ImageFrameSet*)luaL_checkudata(L, 1, "ImageFrameSet");
+
+  lua_newtable(L);
+
+  int i;
+  for(i = 0; i < self->n_streams; ++i) {
+    lua_pushnumber(L, self->streams[i].current_timestamp);
+    lua_rawseti(L, -2, i + 1);
+  }
+
+  return 1;
+}
+
+static const luaL_Reg ImageFrameSet_functions[] = {
+  {NULL, NULL}
+};
+
+static const luaL_Reg ImageFrameSet_methods[] = {
+  {"to_byte_tensor", ImageFrameSet_to_byte_tensor},
+  {"to_float_tensor", ImageFrameSet_to_float_tensor},
+  {"timestamp", ImageFrameSet_timestamp},
+  {"timestamps", ImageFrameSet_timestamps},
+  {NULL, NULL}
+};
+
+static void register_ImageFrameSet(lua_State *L, int m) {
+  luaL_newmetatable(L, "ImageFrameSet");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  luaL_setfuncs(L, ImageFrameSet_methods, 0);
+  lua_pop(L, 1);
+
+  luaL_newlib(L, ImageFrameSet_functions);
+
+  lua_setfield(L, m, "ImageFrameSet");
+}
+
+/***
+Parallel decoding
+@section parallel_decode
+*/
+
+#define MAX_DECODE_THREADS 256
+
+// A range of frames [start_pts, end_pts) which starts on a keyframe
+typedef struct {
+  int64_t start_pts;
+  int64_t end_pts;
+  AVFrame **frames;
+  int n_frames;
+  int capacity;
+  int done;
+  TVError error;
+} DecodeSegment;
+
+struct ParallelDecode;
+
+typedef struct {
+  struct ParallelDecode *decode;
+  AVFormatContext *format_context;
+  AVCodecContext *decoder_context;
+  AVPacket packet;
+  AVFrame *frame;
+  AVFilterGraph *filter_graph;
+  AVFilterContext *buffersrc_context;
+  AVFilterContext *buffersink_context;
+  AVFrame *filtered_frame;
+  int fresh;
+  int thread_started;
+  pthread_t thread;
+} DecodeWorker;
+
+typedef struct ParallelDecode {
+  int video_stream_index;
+  AVRational time_base;
+  DecodeSegment *segments;
+  int n_segments;
+  DecodeWorker *workers;
+  int n_workers;
+  // Index of the next segment to be claimed by a worker
+  int next_segment;
+  // Index of the segment currently being delivered
+  int consume_segment;
+  // Maximum number of segments decoded ahead of the one being delivered
+  int window;
+  // Decoded frames held in segments, and the limit beyond which workers on
+  // segments other than the one being delivered must wait
+  int n_buffered_frames;
+  int max_buffered_frames;
+  int abort;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} ParallelDecode;
+
+static const char* open_video_file(const char *path,
+  AVFormatContext **format_context, AVCodec **decoder, int *stream_index)
+{
+  if(avformat_open_input(format_context, path, NULL, NULL) < 0) {
+    return "failed to open video input";
+  }
+
+  if(avformat_find_stream_info(*format_context, NULL) < 0) {
+    return "failed to find stream info";
+  }
+
+  *stream_index = av_find_best_stream(*format_context, AVMEDIA_TYPE_VIDEO,
+    -1, -1, decoder, 0);
+  if(*stream_index < 0) {
+    return "failed to find video stream";
+  }
+
+  return NULL;
+}
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static const char* scan_keyframes(const char *path, int *stream_index_out,
+  AVRational *time_base_out, int64_t **keyframes_out, int *n_keyframes_out)
+{
+  const char *error_msg = NULL;
+  AVFormatContext *format_context = NULL;
+  AVCodec *decoder;
+  int stream_index;
+  int64_t *keyframes = NULL;
+  int n_keyframes = 0;
+  int capacity = 0;
+  AVPacket packet;
+
+  av_init_packet(&packet);
+  packet.data = NULL;
+  packet.size = 0;
+
+  error_msg = open_video_file(path, &format_context, &decoder, &stream_index);
+  if(error_msg) goto end;
+
+  AVStream *stream = format_context->streams[stream_index];
+  AVRational time_base = stream->time_base;
+
+  // Index timestamps are decoding timestamps, which only match presentation
+  // timestamps when there is no frame reordering
+  if(!(format_context->iformat->flags & AVFMT_GENERIC_INDEX) &&
+    stream->nb_index_entries > 0 && stream->codec->has_b_frames == 0)
+  {
+    // The container has a complete index, so no packets need to be read
+    int i;
+    capacity = stream->nb_index_entries;
+    keyframes = av_malloc_array(capacity, sizeof(int64_t));
+    for(i = 0; i < stream->nb_index_entries; ++i) {
+      if(stream->index_entries[i].flags & AVINDEX_KEYFRAME) {
+        keyframes[n_keyframes++] = stream->index_entries[i].timestamp;
+      }
+    }
+  } else {
+    // Otherwise find keyframes by scanning the packets of the video stream
+    unsigned int i;
+    for(i = 0; i < format_context->nb_streams; ++i) {
+      if(i != (unsigned int)stream_index) {
+        format_context->streams[i]->discard = AVDISCARD_ALL;
+      }
+    }
+
+    for(;;) {
+      av_packet_unref(&packet);
+
+      int errnum = av_read_frame(format_context, &packet);
+      if(errnum == AVERROR(EAGAIN)) {
+        continue;
+      } else if(errnum == AVERROR_EOF) {
+        break;
+      } else if(errnum != 0) {
+        error_msg = "couldn't read packet while scanning for keyframes";
+        goto end;
+      }
+
+      if(packet.stream_index != stream_index ||
+        !(packet.flags & AV_PKT_FLAG_KEY))
+      {
+        continue;
+      }
+
+      int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+      if(pts == AV_NOPTS_VALUE) {
+        continue;
+      }
+
+      if(n_keyframes == capacity) {
+        capacity = capacity > 0 ? capacity * 2 : 256;
+        keyframes = av_realloc_array(keyframes, capacity, sizeof(int64_t));
+      }
+      keyframes[n_keyframes++] = pts;
+    }
+  }
+
+  qsort(keyframes, n_keyframes, sizeof(int64_t), compare_int64);
+
+end:
+  av_packet_unref(&packet);
+  avformat_close_input(&format_context);
+
+  if(error_msg) {
+    av_free(keyframes);
+  } else {
+    *stream_index_out = stream_index;
+    *time_base_out = time_base;
+    *keyframes_out = keyframes;
+    *n_keyframes_out = n_keyframes;
+  }
+
+  return error_msg;
+}
+
+static const char* open_decode_worker(DecodeWorker *worker, const char *path,
+  const char *pixel_format_name, const char *filterchain)
+{
+  AVCodec *decoder;
+  int stream_index;
+
+  const char *error_msg = open_video_file(path, &worker->format_context,
+    &decoder, &stream_index);
+  if(error_msg) return error_msg;
+
+  if(stream_index != worker->decode->video_stream_index) {
+    return "inconsistent video stream selection";
+  }
+
+  worker->decoder_context = worker->format_context->streams[stream_index]->codec;
+  av_opt_set_int(worker->decoder_context, "refcounted_frames", 1, 0);
+  // Parallelism comes from decoding segments concurrently
+  av_opt_set_int(worker->decoder_context, "threads", 1, 0);
+
+  if(avcodec_open2(worker->decoder_context, decoder, NULL) < 0) {
+    return "failed to open video decoder";
+  }
+
+  av_init_packet(&worker->packet);
+  worker->packet.data = NULL;
+  worker->packet.size = 0;
+
+  worker->frame = av_frame_alloc();
+  worker->fresh = 1;
+
+  if(pixel_format_name) {
+    error_msg = create_filter_graph(worker->decoder_context,
+      pixel_format_name, filterchain, &worker->filter_graph,
+      &worker->buffersrc_context, &worker->buffersink_context);
+    if(error_msg) return error_msg;
+    worker->filtered_frame = av_frame_alloc();
+  }
+
+  return NULL;
+}
+
+// Appends a decoded frame to a segment, waiting while too many frames are
+// buffered unless the segment is the one being delivered. Returns nonzero if
+// decoding has been aborted.
+static int append_segment_frame(ParallelDecode *decode, DecodeSegment *segment,
+  AVFrame *frame)
+{
+  int segment_index = segment - decode->segments;
+
+  pthread_mutex_lock(&decode->mutex);
+
+  while(!decode->abort && segment_index != decode->consume_segment &&
+    decode->n_buffered_frames >= decode->max_buffered_frames)
+  {
+    pthread_cond_wait(&decode->cond, &decode->mutex);
+  }
+
+  int aborted = decode->abort;
+
+  if(!aborted) {
+    if(segment->n_frames == segment->capacity) {
+      segment->capacity = segment->capacity > 0 ? segment->capacity * 2 : 64;
+      segment->frames = av_realloc_array(segment->frames, segment->capacity,
+        sizeof(AVFrame*));
+    }
+    segment->frames[segment->n_frames++] = frame;
+    ++decode->n_buffered_frames;
+    pthread_cond_broadcast(&decode->cond);
+  }
+
+  pthread_mutex_unlock(&decode->mutex);
+
+  if(aborted) {
+    av_frame_free(&frame);
+  }
+
+  return aborted;
+}
+
+static TVError push_segment_frame(DecodeWorker *worker, DecodeSegment *segment,
+  int *aborted)
+{
+  if(!worker->filter_graph) {
+    *aborted = append_segment_frame(worker->decode, segment,
+      av_frame_clone(worker->frame));
+    return TVError_None;
+  }
+
+  if(av_buffersrc_add_frame_flags(worker->buffersrc_context, worker->frame,
+    AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+  {
+    return TVError_FilterFail;
+  }
+
+  while(!*aborted &&
+    av_buffersink_get_frame(worker->buffersink_context, worker->filtered_frame) >= 0)
+  {
+    AVFrame *frame = av_frame_alloc();
+    av_frame_move_ref(frame, worker->filtered_frame);
+    *aborted = append_segment_frame(worker->decode, segment, frame);
+  }
+
+  return TVError_None;
+}
+
+// Decodes the frames of a segment after the input has been positioned at or
+// before its starting keyframe. Returns TVError_SeekFail if the first decoded
+// frame lies beyond the start of the segment.
+static TVError decode_segment_frames(DecodeWorker *worker,
+  DecodeSegment *segment)
+{
+  int stream_index = worker->decode->video_stream_index;
+  int first_frame = 1;
+  // The first segment also covers untimestamped frames at the very start
+  int in_segment = segment->start_pts == AV_NOPTS_VALUE;
+  int eof = 0;
+  int aborted = 0;
+
+  while(!aborted) {
+    int found_video_frame = 0;
+
+    av_packet_unref(&worker->packet);
+
+    if(!eof) {
+      int errnum = av_read_frame(worker->format_context, &worker->packet);
+      if(errnum == AVERROR(EAGAIN)) {
+        continue;
+      } else if(errnum == AVERROR_EOF) {
+        // Drain frames buffered inside the decoder
+        eof = 1;
+      } else if(errnum != 0) {
+        return TVError_ReadFail;
+      } else if(worker->packet.stream_index != stream_index) {
+        continue;
+      }
+    }
+
+    av_frame_unref(worker->frame);
+
+    if(avcodec_decode_video2(worker->decoder_context, worker->frame,
+      &found_video_frame, &worker->packet) < 0)
+    {
+      return TVError_DecodeFail;
+    }
+
+    if(!found_video_frame) {
+      if(eof) break;
+      continue;
+    }
+
+    // Frames without a timestamp belong with the preceding timestamped frame,
+    // as when decoding sequentially
+    int64_t pts = av_frame_get_best_effort_timestamp(worker->frame);
+    if(pts == AV_NOPTS_VALUE) {
+      if(in_segment) {
+        TVError err = push_segment_frame(worker, segment, &aborted);
+        if(err != TVError_None) {
+          return err;
+        }
+      }
+      continue;
+    }
+
+    if(first_frame) {
+      first_frame = 0;
+      if(segment->start_pts != AV_NOPTS_VALUE && pts > segment->start_pts) {
+        return TVError_SeekFail;
+      }
+    }
+
+    // Decoder output is in presentation order, so the rest of the stream
+    // belongs to the following segments
+    if(segment->end_pts != AV_NOPTS_VALUE && pts >= segment->end_pts) {
+      break;
+    }
+
+    // Skip pre-roll frames, which belong to the previous segment
+    if(segment->start_pts != AV_NOPTS_VALUE && pts < segment->start_pts) {
+      continue;
+    }
+    in_segment = 1;
+
+    TVError err = push_segment_frame(worker, segment, &aborted);
+    if(err != TVError_None) {
+      return err;
+    }
+  }
+
+  return TVError_None;
+}
+
+static TVError decode_segment(DecodeWorker *worker, DecodeSegment *segment) {
+  ParallelDecode *decode = worker->decode;
+  int attempt;
+
+  for(attempt = 0; attempt < 4; ++attempt) {
+    if(segment->start_pts != AV_NOPTS_VALUE) {
+      // If a previous attempt landed after the keyframe, seek further back
+      int64_t target = segment->start_pts;
+      if(attempt > 0) {
+        target -= av_rescale_q((int64_t)AV_TIME_BASE << (attempt - 1),
+          AV_TIME_BASE_Q, decode->time_base);
+      }
+
+      if(av_seek_frame(worker->format_context, decode->video_stream_index,
+        target, AVSEEK_FLAG_BACKWARD) < 0)
+      {
+        return TVError_SeekFail;
+      }
+    } else if(!worker->fresh) {
+      // The first segment is always claimed before any worker has read
+      return TVError_SeekFail;
+    }
+
+    worker->fresh = 0;
+    avcodec_flush_buffers(worker->decoder_context);
+
+    TVError err = decode_segment_frames(worker, segment);
+    if(err != TVError_SeekFail) {
+      return err;
+    }
+  }
+
+  return TVError_SeekFail;
+}
+
+static void* decode_worker_main(void *arg) {
+  DecodeWorker *worker = (DecodeWorker*)arg;
+  ParallelDecode *decode = worker->decode;
+
+  for(;;) {
+    pthread_mutex_lock(&decode->mutex);
+    while(!decode->abort && decode->next_segment < decode->n_segments &&
+      decode->next_segment >= decode->consume_segment + decode->window)
+    {
+      pthread_cond_wait(&decode->cond, &decode->mutex);
+    }
+    if(decode->abort || decode->next_segment >= decode->n_segments) {
+      pthread_mutex_unlock(&decode->mutex);
+      break;
+    }
+    DecodeSegment *segment = &decode->segments[decode->next_segment++];
+    pthread_mutex_unlock(&decode->mutex);
+
+    TVError err = decode_segment(worker, segment);
+
+    pthread_mutex_lock(&decode->mutex);
+    segment->error = err;
+    segment->done = 1;
+    pthread_cond_broadcast(&decode->cond);
+    pthread_mutex_unlock(&decode->mutex);
+  }
+
+  return NULL;
+}
+
+static void destroy_parallel_decode(ParallelDecode *decode) {
+  int i, j;
+
+  pthread_mutex_lock(&decode->mutex);
+  decode->abort = 1;
+  pthread_cond_broadcast(&decode->cond);
+  pthread_mutex_unlock(&decode->mutex);
+
+  for(i = 0; i < decode->n_workers; ++i) {
+    DecodeWorker *worker = &decode->workers[i];
+
+    if(worker->thread_started) {
+      pthread_join(worker->thread, NULL);
+    }
+
+    if(worker->decoder_context) {
+      avcodec_close(worker->decoder_context);
+    }
+    avformat_close_input(&worker->format_context);
+
+    av_packet_unref(&worker->packet);
+
+    if(worker->frame != NULL) {
+      av_frame_free(&worker->frame);
+    }
+
+    if(worker->filter_graph) {
+      avfilter_graph_free(&worker->filter_graph);
+    }
+
+    if(worker->filtered_frame != NULL) {
+      av_frame_free(&worker->filtered_frame);
+    }
+  }
+
+  for(i = 0; i < decode->n_segments; ++i) {
+    DecodeSegment *segment = &decode->segments[i];
+    for(j = 0; j < segment->n_frames; ++j) {
+      av_frame_free(&segment->frames[j]);
+    }
+    av_free(segment->frames);
+  }
+
+  av_free(decode->workers);
+  av_free(decode->segments);
+
+  pthread_mutex_destroy(&decode->mutex);
+  pthread_cond_destroy(&decode->cond);
+
+  av_free(decode);
+}
+
+static const char* start_parallel_decode(ParallelDecode *decode,
+  const char *path, double segment_duration, const char *pixel_format_name,
+  const char *filterchain)
+{
+  int i;
+  int64_t *keyframes = NULL;
+  int n_keyframes = 0;
+
+  const char *error_msg = scan_keyframes(path, &decode->video_stream_index,
+    &decode->time_base, &keyframes, &n_keyframes);
+  if(error_msg) return error_msg;
+
+  // Start a new segment at the first keyframe at least segment_duration after
+  // the start of the previous one, so that segments span whole GOPs and their
+  // size doesn't grow with the length of the video. The first segment starts
+  // at the beginning of the stream, so it also covers any frames before the
+  // first keyframe.
+  int64_t min_segment_pts = av_rescale_q(
+    (int64_t)(segment_duration * AV_TIME_BASE), AV_TIME_BASE_Q,
+    decode->time_base);
+  decode->segments = av_mallocz_array(n_keyframes + 1, sizeof(DecodeSegment));
+  decode->segments[0].start_pts = AV_NOPTS_VALUE;
+  decode->n_segments = 1;
+  int64_t segment_start = n_keyframes > 0 ? keyframes[0] : 0;
+  for(i = 1; i < n_keyframes; ++i) {
+    int64_t pts = keyframes[i];
+    if(pts - segment_start < min_segment_pts) continue;
+    decode->segments[decode->n_segments - 1].end_pts = pts;
+    decode->segments[decode->n_segments++].start_pts = pts;
+    segment_start = pts;
+  }
+  decode->segments[decode->n_segments - 1].end_pts = AV_NOPTS_VALUE;
+
+  av_free(keyframes);
+
+  // Open every context up front on this thread, since opening codecs is not
+  // safe to do concurrently
+  for(i = 0; i < decode->n_workers; ++i) {
+    DecodeWorker *worker = &decode->workers[i];
+    worker->decode = decode;
+    error_msg = open_decode_worker(worker, path, pixel_format_name,
+      filterchain);
+    if(error_msg) return error_msg;
+  }
+
+  for(i = 0; i < decode->n_workers; ++i) {
+    DecodeWorker *worker = &decode->workers[i];
+    if(pthread_create(&worker->thread, NULL, decode_worker_main, worker) != 0) {
+      return "failed to start decoding thread";
+    }
+    worker->thread_started = 1;
+  }
+
+  return NULL;
+}
+
+// Delivers a frame to a Lua callback or output file. Returns nonzero on
+// failure, leaving an error message on the Lua stack.
+static int deliver_frame(lua_State *L, ParallelDecode *decode, AVFrame *frame,
+  int callback_index, FILE *outfile, byte **buffer, size_t *buffer_size)
+{
+  if(outfile) {
+    PackRegion region = {0, 0, frame->width, frame->height, 1};
+    size_t size = (size_t)calculate_tensor_channels(frame) *
+      frame->width * frame->height;
+
+    if(size > *buffer_size) {
+      av_free(*buffer);
+      *buffer = av_malloc(size);
+      *buffer_size = size;
+    }
+
+    if(pack_any_as_byte(*buffer, frame, &region) < 0) {
+      lua_pushstring(L, "unsupported pixel format");
+      return -1;
+    }
+
+    if(fwrite(*buffer, 1, size, outfile) != size) {
+      lua_pushstring(L, "failed to write to output file");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  ImageFrame *image_frame = lua_newuserdata(L, sizeof(ImageFrame));
+  memset(image_frame, 0, sizeof(ImageFrame));
+  image_frame->frame = frame;
+  image_frame->timestamp =
+    av_frame_get_best_effort_timestamp(frame) * av_q2d(decode->time_base);
+  image_frame->change_score = NAN;
+
+  luaL_getmetatable(L, "ImageFrame");
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, callback_index);
+  lua_pushvalue(L, -2);
+  int failed = lua_pcall(L, 1, 0, 0);
+
+  // The frame is freed once the callback returns, so detach it from any
+  // ImageFrame the callback kept hold of
+  image_frame->frame = NULL;
+  if(failed) {
+    lua_remove(L, -2);
+  } else {
+    lua_pop(L, 1);
+  }
+
+  return failed;
+}
+
+/***
+Decodes a whole video using several threads.
+
+The video stream is split at keyframes into segments, which are decoded
+concurrently, each thread with its own demuxer and decoder. Frames are
+delivered in presentation order without duplicates or gaps at segment
+boundaries.
+
+Frames are either passed to a callback function as `ImageFrame` objects
+(whose pixel data is only available for the duration of the call; afterwards
+the tensor methods raise an error), or packed as bytes in
+the layout of `ImageFrame:to_byte_tensor` and appended to an output file.
+
+Options:
+
+* `threads`: number of decoding threads, at most 256 (defaults to the number
+  of CPUs).
+* `segment_duration`: minimum length of a segment in seconds (defaults to
+  2). Segments always span whole GOPs, so they may be longer.
+* `buffered_segments`: maximum number of segments decoded ahead of the one
+  being delivered (defaults to twice the number of threads).
+* `max_buffered_frames`: maximum number of decoded frames held ahead of
+  delivery, which bounds memory usage (defaults to 32 per thread).
+* `pixel_format`, `filterchain`: apply a filterchain to decoded frames, as
+  for `Video:filter`. The filterchain must not carry state between frames.
+
+@function parallel_decode
+@string path Absolute or relative path to a video file.
+@tparam[opt] table options Decoding options.
+@tparam function|string callback_or_outfile Function called with each frame, or
+  path of a file to write frames to.
+@treturn number The number of frames delivered.
+*/
+static int parallel_decode(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  lua_Integer n_threads = n_cpus > 0 ? n_cpus : 1;
+  lua_Number segment_duration = 2;
+  lua_Integer window = 0;
+  lua_Integer max_buffered_frames = 0;
+  const char *pixel_format_name = NULL;
+  const char *filterchain = "null";
+
+  if(!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n_threads = get_integer_field(L, 2, "threads", n_threads);
+    segment_duration = get_number_field(L, 2, "segment_duration",
+      segment_duration);
+    window = get_integer_field(L, 2, "buffered_segments", 0);
+    max_buffered_frames = get_integer_field(L, 2, "max_buffered_frames", 0);
+    pixel_format_name = get_string_field(L, 2, "pixel_format", NULL);
+    filterchain = get_string_field(L, 2, "filterchain", filterchain);
+  }
+
+  // Validate at full width before narrowing, so that huge values can't wrap
+  if(n_threads < 1 || n_threads > MAX_DECODE_THREADS) {
+    return luaL_error(L, "threads must be between 1 and %d",
+      MAX_DECODE_THREADS);
+  }
+  luaL_argcheck(L, window <= INT_MAX && max_buffered_frames <= INT_MAX, 2,
+    "buffered_segments and max_buffered_frames must fit in an int");
+  luaL_argcheck(L, segment_duration >= 0, 2,
+    "segment_duration must not be negative");
+  if(window < 1) window = n_threads * 2;
+  if(max_buffered_frames < 1) max_buffered_frames = n_threads * 32;
+
+  int callback_index = 0;
+  const char *outfile_path = NULL;
+  if(lua_isfunction(L, 3)) {
+    callback_index = 3;
+  } else if(lua_isstring(L, 3)) {
+    outfile_path = lua_tostring(L, 3);
+  } else {
+    return luaL_argerror(L, 3, "function or output file path expected");
+  }
+
+  FILE *outfile = NULL;
+  if(outfile_path) {
+    outfile = fopen(outfile_path, "wb");
+    if(outfile == NULL) {
+      return luaL_error(L, "failed to open output file %s", outfile_path);
+    }
+  }
+
+  ParallelDecode *decode = av_mallocz(sizeof(ParallelDecode));
+  pthread_mutex_init(&decode->mutex, NULL);
+  pthread_cond_init(&decode->cond, NULL);
+  decode->window = window;
+  decode->max_buffered_frames = max_buffered_frames;
+  decode->n_workers = n_threads;
+  decode->workers = av_mallocz_array(n_threads, sizeof(DecodeWorker));
+
+  const char *error_msg = start_parallel_decode(decode, path, segment_duration,
+    pixel_format_name, filterchain);
+
+  if(error_msg) {
+    destroy_parallel_decode(decode);
+    if(outfile) fclose(outfile);
+    return luaL_error(L, "%s for %s", error_msg, path);
+  }
+
+  lua_Integer n_delivered = 0;
+  int failed = 0;
+  byte *buffer = NULL;
+  size_t buffer_size = 0;
+  int i;
+
+  for(i = 0; i < decode->n_segments && !failed; ++i) {
+    DecodeSegment *segment = &decode->segments[i];
+    int frame_index = 0;
+
+    for(;;) {
+      pthread_mutex_lock(&decode->mutex);
+      while(frame_index >= segment->n_frames && !segment->done) {
+        pthread_cond_wait(&decode->cond, &decode->mutex);
+      }
+
+      if(frame_index < segment->n_frames) {
+        AVFrame *frame = segment->frames[frame_index];
+        segment->frames[frame_index++] = NULL;
+        --decode->n_buffered_frames;
+        pthread_cond_broadcast(&decode->cond);
+        pthread_mutex_unlock(&decode->mutex);
+
+        failed = deliver_frame(L, decode, frame, callback_index, outfile,
+          &buffer, &buffer_size);
+        av_frame_free(&frame);
+        if(failed) break;
+        ++n_delivered;
+        continue;
+      }
+
+      TVError err = segment->error;
+      decode->consume_segment = i + 1;
+      pthread_cond_broadcast(&decode->cond);
+      pthread_mutex_unlock(&decode->mutex);
+
+      switch(err) {
+        case TVError_None:
+        case TVError_EOF:
+          break;
+        case TVError_ReadFail:
+          lua_pushstring(L, "couldn't read next frame");
+          failed = 1;
+          break;
+        case TVError_DecodeFail:
+          lua_pushstring(L, "couldn't decode video frame");
+          failed = 1;
+          break;
+        case TVError_FilterFail:
+          lua_pushstring(L, "error while feeding the filtergraph");
+          failed = 1;
+          break;
+        case TVError_SeekFail:
+          lua_pushstring(L, "couldn't seek to segment keyframe");
+          failed = 1;
+          break;
+      }
+      break;
+    }
+  }
+
+  destroy_parallel_decode(decode);
+  av_free(buffer);
+
+  if(outfile && fclose(outfile) != 0 && !failed) {
+    lua_pushstring(L, "failed to write to output file");
+    failed = 1;
+  }
+
+  if(failed) {
+    return lua_error(L);
+  }
+
+  lua_pushinteger(L, n_delivered);
+
+  return 1;
+}
+
+/***
+@type VideoWriter
+*/
+typedef struct {
+  // Options
+  char *path;
+  char *format_name;
+  char *codec_name;
+  enum AVPixelFormat pix_fmt;
+  AVRational frame_rate;
+  int gop_size;
+  int64_t bit_rate;
+  int queue_size;
+  // Encoder state, set up when the first frame is written
+  int width;
+  int height;
+  int64_t next_pts;
+  AVFormatContext *format_context;
+  AVStream *stream;
+  AVCodecContext *encoder_context;
+  struct SwsContext *sws_context;
+  AVFrame *converted_frame;
+  int header_written;
+  // Memory output
+  AVIOContext *avio_context;
+  byte *buffer;
+  size_t buffer_size;
+  size_t buffer_capacity;
+  // Frames waiting to be encoded on the background thread
+  AVFrame **queue;
+  int queue_start;
+  int queue_length;
+  int finishing;
+  const char *error;
+  int closed;
+  int thread_started;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} VideoWriter;
+
+static int is_packable_pix_fmt(enum AVPixelFormat pix_fmt) {
+  switch(pix_fmt) {
+    case AV_PIX_FMT_RGB24:
+    case AV_PIX_FMT_GRAY8:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUV422P:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Inverse of normalize_float_tensor, rescaling values to [0, 255]
+static void denormalize_float_tensor(THFloatTensor *tensor,
+  enum AVPixelFormat pix_fmt)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+  int is_yuv = !(desc->flags & PIX_FMT_RGB) && desc->nb_components >= 2;
+
+  if(is_yuv) {
+    THFloatTensor *tensor_y = THFloatTensor_newSelect(tensor, 0, 0);
+    THFloatTensor_mul(tensor_y, tensor_y, 255);
+    THFloatTensor_free(tensor_y);
+
+    THFloatTensor *tensor_u = THFloatTensor_newSelect(tensor, 0, 1);
+    THFloatTensor_add(tensor_u, tensor_u, 1);
+    THFloatTensor_mul(tensor_u, tensor_u, 128);
+    THFloatTensor_free(tensor_u);
+
+    THFloatTensor *tensor_v = THFloatTensor_newSelect(tensor, 0, 2);
+    THFloatTensor_add(tensor_v, tensor_v, 1);
+    THFloatTensor_mul(tensor_v, tensor_v, 128);
+    THFloatTensor_free(tensor_v);
+  } else {
+    THFloatTensor_mul(tensor, tensor, 255);
+  }
+}
+
+static int write_memory_packet(void *opaque, uint8_t *buf, int buf_size) {
+  VideoWriter *self = (VideoWriter*)opaque;
+
+  if(self->buffer_size + buf_size > self->buffer_capacity) {
+    size_t capacity = FFMAX(self->buffer_capacity * 2,
+      self->buffer_size + buf_size);
+    byte *buffer = av_realloc(self->buffer, capacity);
+    if(buffer == NULL) {
+      return AVERROR(ENOMEM);
+    }
+    self->buffer = buffer;
+    self->buffer_capacity = capacity;
+  }
+
+  memcpy(self->buffer + self->buffer_size, buf, buf_size);
+  self->buffer_size += buf_size;
+
+  return buf_size;
+}
+
+// Encodes a frame and writes out any resulting packets. Passing NULL flushes
+// frames buffered inside the encoder.
+static const char* encode_video_frame(VideoWriter *self, AVFrame *frame) {
+  AVFrame *input = frame;
+
+  if(frame && self->sws_context) {
+    if(av_frame_make_writable(self->converted_frame) < 0) {
+      return "failed to allocate video frame";
+    }
+    sws_scale(self->sws_context,
+      (const uint8_t * const*)frame->data, frame->linesize, 0, frame->height,
+      self->converted_frame->data, self->converted_frame->linesize);
+    self->converted_frame->pts = frame->pts;
+    input = self->converted_frame;
+  }
+
+  for(;;) {
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    int got_packet = 0;
+    if(avcodec_encode_video2(self->encoder_context, &packet, input,
+      &got_packet) < 0)
+    {
+      return "failed to encode video frame";
+    }
+
+    if(!got_packet) {
+      break;
+    }
+
+    av_packet_rescale_ts(&packet, self->encoder_context->time_base,
+      self->stream->time_base);
+    packet.stream_index = self->stream->index;
+
+    if(av_interleaved_write_frame(self->format_context, &packet) < 0) {
+      return "failed to write video packet";
+    }
+
+    // When flushing, keep going until the encoder is drained
+    if(input != NULL) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void* video_writer_main(void *arg) {
+  VideoWriter *self = (VideoWriter*)arg;
+  const char *error = NULL;
+
+  for(;;) {
+    pthread_mutex_lock(&self->mutex);
+    while(self->queue_length == 0 && !self->finishing) {
+      pthread_cond_wait(&self->cond, &self->mutex);
+    }
+    if(self->queue_length == 0) {
+      pthread_mutex_unlock(&self->mutex);
+      break;
+    }
+    AVFrame *frame = self->queue[self->queue_start];
+    self->queue_start = (self->queue_start + 1) % self->queue_size;
+    --self->queue_length;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+
+    error = encode_video_frame(self, frame);
+    av_frame_free(&frame);
+    if(error) break;
+  }
+
+  if(!error) {
+    error = encode_video_frame(self, NULL);
+  }
+
+  pthread_mutex_lock(&self->mutex);
+  self->error = error;
+  pthread_cond_broadcast(&self->cond);
+  pthread_mutex_unlock(&self->mutex);
+
+  return NULL;
+}
+
+static const char* open_video_writer(VideoWriter *self, int width, int height) {
+  self->width = width;
+  self->height = height;
+
+  if(avformat_alloc_output_context2(&self->format_context, NULL,
+    self->format_name, self->path) < 0)
+  {
+    return "failed to determine output format";
+  }
+
+  AVCodec *encoder = avcodec_find_encoder_by_name(self->codec_name);
+  if(encoder == NULL) {
+    return "unknown codec";
+  }
+
+  self->stream = avformat_new_stream(self->format_context, encoder);
+  if(self->stream == NULL) {
+    return "failed to create output stream";
+  }
+
+  AVCodecContext *encoder_context = self->stream->codec;
+  encoder_context->codec_id = encoder->id;
+  encoder_context->codec_type = AVMEDIA_TYPE_VIDEO;
+  encoder_context->width = width;
+  encoder_context->height = height;
+  encoder_context->time_base = av_inv_q(self->frame_rate);
+  encoder_context->gop_size = self->gop_size;
+  if(self->bit_rate > 0) {
+    encoder_context->bit_rate = self->bit_rate;
+  }
+  self->stream->time_base = encoder_context->time_base;
+
+  encoder_context->pix_fmt = self->pix_fmt;
+  if(encoder->pix_fmts) {
+    encoder_context->pix_fmt = avcodec_find_best_pix_fmt_of_list(
+      encoder->pix_fmts, self->pix_fmt, 0, NULL);
+  }
+
+  if(self->format_context->oformat->flags & AVFMT_GLOBALHEADER) {
+    encoder_context->flags |= CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if(avcodec_open2(encoder_context, encoder, NULL) < 0) {
+    return "failed to open video encoder";
+  }
+  self->encoder_context = encoder_context;
+
+  if(encoder_context->pix_fmt != self->pix_fmt) {
+    self->sws_context = sws_getCachedContext(NULL,
+      width, height, self->pix_fmt,
+      width, height, encoder_context->pix_fmt,
+      SWS_BICUBIC, NULL, NULL, NULL);
+    if(self->sws_context == NULL) {
+      return "failed to set up pixel format conversion";
+    }
+
+    self->converted_frame = av_frame_alloc();
+    self->converted_frame->format = encoder_context->pix_fmt;
+    self->converted_frame->width = width;
+    self->converted_frame->height = height;
+    if(av_frame_get_buffer(self->converted_frame, 32) < 0) {
+      return "failed to allocate video frame";
+    }
+  }
+
+  if(self->path == NULL) {
+    unsigned char *avio_buffer = av_malloc(4096);
+    self->avio_context = avio_alloc_context(avio_buffer, 4096, 1, self,
+      NULL, write_memory_packet, NULL);
+    self->format_context->pb = self->avio_context;
+    self->format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+  } else if(!(self->format_context->oformat->flags & AVFMT_NOFILE)) {
+    if(avio_open(&self->format_context->pb, self->path, AVIO_FLAG_WRITE) < 0) {
+      return "failed to open output file";
+    }
+  }
+
+  if(avformat_write_header(self->format_context, NULL) < 0) {
+    return "failed to write container header";
+  }
+  self->header_written = 1;
+
+  self->queue = av_malloc_array(self->queue_size, sizeof(AVFrame*));
+
+  if(pthread_create(&self->thread, NULL, video_writer_main, self) != 0) {
+    return "failed to start encoding thread";
+  }
+  self->thread_started = 1;
+
+  return NULL;
+}
+
+// Finishes encoding and releases all resources. Returns the first error
+// encountered while encoding, if any.
+static const char* finish_video_writer(VideoWriter *self) {
+  const char *error = NULL;
+
+  if(self->closed) {
+    return NULL;
+  }
+  self->closed = 1;
+
+  if(self->thread_started) {
+    pthread_mutex_lock(&self->mutex);
+    self->finishing = 1;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+
+    pthread_join(self->thread, NULL);
+    error = self->error;
+  }
+
+  // Only a container whose header was written needs its trailer
+  if(!error && self->header_written &&
+    av_write_trailer(self->format_context) < 0)
+  {
+    error = "failed to write container trailer";
+  }
+
+  while(self->queue_length > 0) {
+    av_frame_free(&self->queue[self->queue_start]);
+    self->queue_start = (self->queue_start + 1) % self->queue_size;
+    --self->queue_length;
+  }
+  av_free(self->queue);
+
+  if(self->encoder_context) {
+    avcodec_close(self->encoder_context);
+  }
+
+  if(self->format_context) {
+    if(self->avio_context) {
+      av_freep(&self->avio_context->buffer);
+      av_freep(&self->avio_context);
+    } else if(!(self->format_context->oformat->flags & AVFMT_NOFILE)) {
+      avio_closep(&self->format_context->pb);
+    }
+    avformat_free_context(self->format_context);
+  }
+
+  if(self->sws_context) {
+    sws_freeContext(self->sws_context);
+  }
+  av_frame_free(&self->converted_frame);
+
+  av_free(self->path);
+  av_free(self->format_name);
+  av_free(self->codec_name);
+
+  pthread_mutex_destroy(&self->mutex);
+  pthread_cond_destroy(&self->cond);
+
+  return error;
+}
+
+/***
+Creates a new VideoWriter, which encodes tensors into a video.
+
+Frames are encoded on a background thread. Options:
+
+* `codec`: name of the encoder (defaults to "mpeg4"). Use a lossless codec
+  such as "ffv1" to preserve pixel values exactly.
+* `format`: container format name. Guessed from the path by default, but
+  required when writing to memory. Formats which need to seek back in the
+  output (eg "mp4") can't be written to memory.
+* `pixel_format`: layout of the tensors to write, as produced by
+  `ImageFrame:to_byte_tensor` for frames of that format (defaults to
+  "yuv420p"). Frames are converted if the encoder needs a different format.
+* `frame_rate`: frames per second (defaults to 25).
+* `gop_size`: maximum number of frames between keyframes (defaults to 12).
+* `bit_rate`: target bit rate in bits per second.
+* `queue_size`: maximum number of frames waiting to be encoded (defaults
+  to 8).
+
+@function VideoWriter.new
+@tparam string|nil path Path of the output file, or nil to write to memory.
+@tparam[opt] table options Encoding options.
+@treturn VideoWriter
+*/
+static int VideoWriter_new(lua_State *L) {
+  const char *path = lua_isnoneornil(L, 1) ? NULL : luaL_checkstring(L, 1);
+
+  const char *format_name = NULL;
+  const char *codec_name = "mpeg4";
+  const char *pixel_format_name = "yuv420p";
+  lua_Number frame_rate = 25;
+  lua_Integer gop_size = 12;
+  lua_Integer bit_rate = 0;
+  lua_Integer queue_size = 8;
+
+  if(!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    format_name = get_string_field(L, 2, "format", NULL);
+    codec_name = get_string_field(L, 2, "codec", codec_name);
+    pixel_format_name = get_string_field(L, 2, "pixel_format", pixel_format_name);
+    gop_size = get_integer_field(L, 2, "gop_size", gop_size);
+    bit_rate = get_integer_field(L, 2, "bit_rate", bit_rate);
+    queue_size = get_integer_field(L, 2, "queue_size", queue_size);
+
+    frame_rate = get_number_field(L, 2, "frame_rate", frame_rate);
+  }
+
+  if(path == NULL && format_name == NULL) {
+    return luaL_error(L, "format must be specified when writing to memory");
+  }
+
+  enum AVPixelFormat pix_fmt = av_get_pix_fmt(pixel_format_name);
+  if(!is_packable_pix_fmt(pix_fmt)) {
+    return luaL_error(L, "unsupported pixel format %s", pixel_format_name);
+  }
+
+  if(frame_rate <= 0 || gop_size < 1 || queue_size < 1) {
+    return luaL_error(L, "frame_rate, gop_size and queue_size must be positive");
+  }
+
+  VideoWriter *self = lua_newuserdata(L, sizeof(VideoWriter));
+  memset(self, 0, sizeof(VideoWriter));
+
+  self->path = path ? av_strdup(path) : NULL;
+  self->format_name = format_name ? av_strdup(format_name) : NULL;
+  self->codec_name = av_strdup(codec_name);
+  self->pix_fmt = pix_fmt;
+  self->frame_rate = av_d2q(frame_rate, 100000);
+  self->gop_size = gop_size;
+  self->bit_rate = bit_rate;
+  self->queue_size = queue_size;
+
+  pthread_mutex_init(&self->mutex, NULL);
+  pthread_cond_init(&self->cond, NULL);
+
+  luaL_getmetatable(L, "VideoWriter");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+/***
+Queues a frame for encoding.
+
+The tensor must be C x H x W in the layout of the writer's pixel format, as a
+`torch.ByteTensor` or as a `torch.FloatTensor` with values in the ranges
+produced by `ImageFrame:to_float_tensor`. All frames must have the same size.
+
+@function write
+@tparam torch.ByteTensor|torch.FloatTensor tensor The frame pixel data.
+@treturn VideoWriter This writer.
+*/
+static int VideoWriter_write(lua_State *L) {
+  VideoWriter *self = (VideoWriter*)luaL_checkudata(L, 1, "VideoWriter");
+
+  THByteTensor *byte_tensor = luaT_toudata(L, 2, "torch.ByteTensor");
+  THFloatTensor *float_tensor = luaT_toudata(L, 2, "torch.FloatTensor");
+
+  if(byte_tensor == NULL && float_tensor == NULL) {
+    return luaL_argerror(L, 2, "torch.ByteTensor or torch.FloatTensor expected");
+  }
+
+  if(self->closed) {
+    return luaL_error(L, "video writer is closed");
+  }
+
+  int n_dims = byte_tensor ? THByteTensor_nDimension(byte_tensor) :
+    THFloatTensor_nDimension(float_tensor);
+  long n_channels = byte_tensor ? THByteTensor_size(byte_tensor, 0) :
+    THFloatTensor_size(float_tensor, 0);
+  int expected_channels = self->pix_fmt == AV_PIX_FMT_GRAY8 ? 1 : 3;
+
+  if(n_dims != 3 || n_channels != expected_channels) {
+    return luaL_error(L, "expected a %d x H x W tensor", expected_channels);
+  }
+
+  int height = byte_tensor ? THByteTensor_size(byte_tensor, 1) :
+    THFloatTensor_size(float_tensor, 1);
+  int width = byte_tensor ? THByteTensor_size(byte_tensor, 2) :
+    THFloatTensor_size(float_tensor, 2);
+
+  if(self->format_context == NULL) {
+    const char *error_msg = open_video_writer(self, width, height);
+    if(error_msg) {
+      finish_video_writer(self);
+      return luaL_error(L, error_msg);
+    }
+  } else if(width != self->width || height != self->height) {
+    return luaL_error(L, "frame size differs from previous frames");
+  }
+
+  AVFrame *frame = av_frame_alloc();
+  frame->format = self->pix_fmt;
+  frame->width = width;
+  frame->height = height;
+  if(av_frame_get_buffer(frame, 32) < 0) {
+    av_frame_free(&frame);
+    return luaL_error(L, "failed to allocate video frame");
+  }
+
+  if(byte_tensor) {
+    THByteTensor *contiguous = THByteTensor_newContiguous(byte_tensor);
+    unpack_any_from_byte(frame, THByteTensor_data(contiguous));
+    THByteTensor_free(contiguous);
+  } else {
+    THFloatTensor *scaled = THFloatTensor_newClone(float_tensor);
+    denormalize_float_tensor(scaled, self->pix_fmt);
+    unpack_any_from_float(frame, THFloatTensor_data(scaled));
+    THFloatTensor_free(scaled);
+  }
+
+  frame->pts = self->next_pts++;
+
+  pthread_mutex_lock(&self->mutex);
+  while(self->queue_length == self->queue_size && !self->error) {
+    pthread_cond_wait(&self->cond, &self->mutex);
+  }
+  const char *error = self->error;
+  if(!error) {
+    int index = (self->queue_start + self->queue_length) % self->queue_size;
+    self->queue[index] = frame;
+    ++self->queue_length;
+    pthread_cond_broadcast(&self->cond);
+  }
+  pthread_mutex_unlock(&self->mutex);
+
+  if(error) {
+    av_frame_free(&frame);
+    return luaL_error(L, error);
+  }
+
+  lua_pop(L, 1);
+
+  return 1;
+}
+
+/***
+Finishes encoding and closes the output. Raises an error if no frames were
+written, since the output can't be created without knowing the frame size.
+
+@function close
+@treturn string|nil The encoded video when writing to memory, otherwise nil.
+*/
+static int VideoWriter_close(lua_State *L) {
+  VideoWriter *self = (VideoWriter*)luaL_checkudata(L, 1, "VideoWriter");
+
+  if(self->closed) {
+    return luaL_error(L, "video writer is already closed");
+  }
+
+  int to_memory = self->path == NULL;
+  // The output is only opened once the first frame gives its size
+  int opened = self->format_context != NULL;
+  const char *error = finish_video_writer(self);
+  if(!error && !opened) {
+    error = "no frames were written";
+  }
+
+  if(error) {
+    av_freep(&self->buffer);
+    return luaL_error(L, error);
+  }
+
+  if(to_memory) {
+    lua_pushlstring(L, (const char*)self->buffer, self->buffer_size);
+  } else {
+    lua_pushnil(L);
+  }
+  av_freep(&self->buffer);
+
+  return 1;
+}
+
+static int VideoWriter_destroy(lua_State *L) {
+  VideoWriter *self = (VideoWriter*)luaL_checkudata(L, 1, "VideoWriter");
+
+  finish_video_writer(self);
+  av_freep(&self->buffer);
+
+  return 0;
+}
+
+static const luaL_Reg VideoWriter_functions[] = {
+  {"new", VideoWriter_new},
+  {NULL, NULL}
+};
+
+static const luaL_Reg VideoWriter_methods[] = {
+  {"write", VideoWriter_write},
+  {"close", VideoWriter_close},
+  {"__gc", VideoWriter_destroy},
+  {NULL, NULL}
+};
+
+static void register_VideoWriter(lua_State *L, int m) {
+  luaL_newmetatable(L, "VideoWriter");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  luaL_setfuncs(L, VideoWriter_methods, 0);
+  lua_pop(L, 1);
+
+  luaL_newlib(L, VideoWriter_functions);
+
+  lua_setfield(L, m, "VideoWriter");
+}
+
+int luaopen_torchvid(lua_State *L) {
+  // Initialization
+  av_log_set_level(AV_LOG_ERROR);
+  avcodec_register_all();
+  av_register_all();
+  avfilter_register_all();
+
+  // Create table for module
+  lua_newtable(L);
+  int m = lua_gettop(L);
+
+  // Add values for classes
+  register_Video(L, m);
+  register_ImageFrame(L, m);
+  register_ImageFrameSet(L, m);
+  register_VideoWriter(L, m);
+
+  // Add module functions
+  lua_pushcfunction(L, parallel_decode);
+  lua_setfield(L, m, "parallel_decode");
 
   return 1;
 }
@@ -11,3 +11,25 @@ else
   touch data_downloaded
   echo "Test data downloaded successfully"
 fi
+
+# Fixtures derived from the downloaded data are generated separately, so that
+# existing downloads pick up new ones
+if [ ! -f multi_stream.mkv ]; then
+  echo "Generating multi_stream.mkv..."
+  # Two video streams (the second mirrored) and a silent audio stream
+  ffmpeg -loglevel error -i centaur_1.mpg -f lavfi -i anullsrc=r=44100:cl=mono \
+    -filter_complex '[0:v]split[v0][v1];[v1]hflip[v1f]' \
+    -map '[v0]' -map '[v1f]' -map 1:a -shortest \
+    -c:v mpeg2video -q:v 2 -c:a mp2 -f matroska multi_stream.mkv.tmp
+  mv multi_stream.mkv.tmp multi_stream.mkv
+fi
+
+if [ ! -f offset_streams.mkv ]; then
+  echo "Generating offset_streams.mkv..."
+  # The second video stream starts 2 seconds late and stops 4 seconds early
+  ffmpeg -loglevel error -i centaur_1.mpg \
+    -filter_complex '[0:v]split[v0][v1];[v1]trim=start=2:end=10[v1t]' \
+    -map '[v0]' -map '[v1t]' \
+    -c:v mpeg2video -q:v 2 -f matroska offset_streams.mkv.tmp
+  mv offset_streams.mkv.tmp offset_streams.mkv
+fi
@@ -10,6 +10,50 @@ describe('torchvid', function()
       video = torchvid.Video.new('./test/data/centaur_1.mpg')
     end)
 
+    describe('.new', function()
+      it('should accept bounded probe options', function()
+        local bounded_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          format = 'mpeg',
+          probesize = 32768,
+          analyzeduration = 100000
+        })
+        local tensor = bounded_video:next_image_frame():to_byte_tensor()
+        assert.are.same({3, 240, 320}, tensor:size():totable())
+      end)
+
+      it('should skip probing when given trusted stream params', function()
+        local params = video:stream_params()
+        local trusted_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          stream_params = params
+        })
+        assert.are.same(params, trusted_video:stream_params())
+        local tensor = trusted_video:next_image_frame():to_byte_tensor()
+        assert.are.same({3, 240, 320}, tensor:size():totable())
+      end)
+
+      it('should skip probing for containers with stream headers', function()
+        local path = './test/data/multi_stream.mkv'
+        local params = torchvid.Video.new(path):stream_params()
+        local trusted_video = torchvid.Video.new(path, {
+          format = 'matroska',
+          stream_params = params
+        })
+        assert.are.same(params, trusted_video:stream_params())
+        assert.is_near(30, trusted_video:guess_image_frame_rate(), 0.1)
+        local tensor = trusted_video:next_image_frame():to_byte_tensor()
+        assert.are.same({3, 240, 320}, tensor:size():totable())
+      end)
+    end)
+
+    describe(':stream_params', function()
+      it('should describe the video stream', function()
+        local params = video:stream_params()
+        assert.are.same('yuv420p', params.pixel_format)
+        assert.are.same(320, params.width)
+        assert.are.same(240, params.height)
+      end)
+    end)
+
     describe(':duration', function()
       it('should return the approximate video duration', function()
         local expected = 14.0754
@@ -31,6 +75,54 @@ describe('torchvid', function()
         assert.is_not_nil(frame)
       end)
 
+      it('should skip frames which changed less than min_change', function()
+        local scored_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          change_detection = 'luma'
+        })
+        local min_change = 0.02
+        local scores = {}
+        local ok, err
+        repeat
+          ok, err = pcall(function()
+            local frame = scored_video:next_image_frame{min_change = min_change}
+            scores[#scores + 1] = frame:change_score()
+          end)
+        until not ok
+        assert.matches('reached end of video', err)
+        for _, score in ipairs(scores) do
+          assert.is_true(score >= min_change)
+        end
+        local n_frames = #scores
+        assert.is_true(n_frames > 0)
+        assert.is_true(n_frames < n_video_frames)
+      end)
+
+      it('should apply min_change with a buffering filterchain', function()
+        local scored_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          change_detection = 'luma'
+        }):filter('gray', 'yadif,fps=fps=10')
+        local min_change = 0.02
+        local scores = {}
+        local ok, err
+        repeat
+          ok, err = pcall(function()
+            local frame = scored_video:next_image_frame{min_change = min_change}
+            scores[#scores + 1] = frame:change_score()
+          end)
+        until not ok
+        assert.matches('reached end of video', err)
+        assert.is_true(#scores > 0)
+        for _, score in ipairs(scores) do
+          assert.is_true(score >= min_change)
+        end
+      end)
+
+      it('should require change detection for min_change', function()
+        assert.has_error(function()
+          video:next_image_frame{min_change = 0.5}
+        end)
+      end)
+
       it('should return error after end of stream is reached', function()
         local ok = true
         for i=0,n_video_frames do
@@ -41,6 +133,94 @@ describe('torchvid', function()
       end)
     end)
 
+    describe(':next_image_frame_set', function()
+      local stream_index
+
+      before_each(function()
+        stream_index = video:stream_params().stream_index
+      end)
+
+      it('should pack frames from the selected streams into one tensor', function()
+        local multi_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          streams = {stream_index}
+        })
+        local frame_set = multi_video:next_image_frame_set()
+        assert.are.same({1, 3, 240, 320}, frame_set:to_byte_tensor():size():totable())
+        assert.are.same(1, #frame_set:timestamps())
+      end)
+
+      it('should match the frames read from a single stream', function()
+        local multi_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          streams = {stream_index}
+        }):filter('gray', 'scale=4:3')
+        local expected = video:filter('gray', 'scale=4:3'):next_image_frame()
+        local actual = multi_video:next_image_frame_set()
+        assert.are.same({expected:to_byte_tensor():totable()}, actual:to_byte_tensor():totable())
+        assert.is_near(expected:timestamp(), actual:timestamp(), 0.0001)
+      end)
+
+      it('should align frames of two video streams', function()
+        local multi_video = torchvid.Video.new('./test/data/multi_stream.mkv', {
+          streams = {0, 1}
+        })
+        for i = 1, 10 do
+          local frame_set = multi_video:next_image_frame_set()
+          assert.are.same({2, 3, 240, 320}, frame_set:to_byte_tensor():size():totable())
+          local timestamps = frame_set:timestamps()
+          assert.are.same(2, #timestamps)
+          assert.is_near(timestamps[1], timestamps[2], 0.0001)
+          assert.is_near(frame_set:timestamp(), timestamps[1], 0.0001)
+        end
+      end)
+
+      it('should order frames by the listed streams', function()
+        local multi_video = torchvid.Video.new('./test/data/multi_stream.mkv', {
+          streams = {1, 0}
+        }):filter('gray', 'scale=4:3')
+        local reference = torchvid.Video.new('./test/data/multi_stream.mkv')
+          :filter('gray', 'scale=4:3')
+        local expected = reference:next_image_frame():to_byte_tensor()
+        local actual = multi_video:next_image_frame_set():to_byte_tensor()
+        assert.are.same(expected:totable(), actual[2]:totable())
+      end)
+
+      it('should only return frame sets where every stream has a frame', function()
+        for _, streams in ipairs{{0, 1}, {1, 0}} do
+          local multi_video = torchvid.Video.new('./test/data/offset_streams.mkv', {
+            streams = streams,
+            sync_lookahead = 0.5
+          })
+          local timestamps = {}
+          local ok, err
+          repeat
+            ok, err = pcall(function()
+              timestamps[#timestamps + 1] = multi_video:next_image_frame_set():timestamp()
+            end)
+          until not ok
+          assert.matches('reached end of video', err)
+          assert.is_true(#timestamps > 200)
+          assert.is_near(2, timestamps[1], 0.05)
+          assert.is_near(10, timestamps[#timestamps], 0.1)
+        end
+      end)
+
+      it('should reject indices of streams which are not video', function()
+        assert.has_error(function()
+          torchvid.Video.new('./test/data/multi_stream.mkv', {streams = {0, 2}})
+        end)
+        assert.has_error(function()
+          torchvid.Video.new('./test/data/multi_stream.mkv', {streams = {0, 99}})
+        end)
+      end)
+
+      it('should not be mixed with next_image_frame', function()
+        local multi_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          streams = {stream_index}
+        })
+        assert.has_error(function() multi_video:next_image_frame() end)
+      end)
+    end)
+
     describe(':guess_image_frame_rate', function()
       it('should return the correct average frame rate', function()
         assert.is_near(30, video:guess_image_frame_rate(), 0.1)
@@ -66,6 +246,77 @@ describe('torchvid', function()
     end)
   end)
 
+  describe('parallel_decode', function()
+    local path = './test/data/centaur_1.mpg'
+
+    local function sequential_timestamps()
+      local video = torchvid.Video.new(path)
+      local timestamps = {}
+      while pcall(function()
+        table.insert(timestamps, video:next_image_frame():timestamp())
+      end) do end
+      return timestamps
+    end
+
+    it('should deliver every frame exactly once in order', function()
+      local expected = sequential_timestamps()
+      local actual = {}
+      local options = {threads = 4, segment_duration = 1, max_buffered_frames = 8}
+      local n_frames = torchvid.parallel_decode(path, options,
+        function(frame)
+          table.insert(actual, frame:timestamp())
+        end)
+      assert.are.same(#expected, n_frames)
+      assert.are.same(expected, actual)
+    end)
+
+    it('should apply the filterchain to each frame', function()
+      local sizes = {}
+      torchvid.parallel_decode(path, {threads = 2, pixel_format = 'gray', filterchain = 'scale=32:24'},
+        function(frame)
+          sizes[#sizes + 1] = frame:to_byte_tensor():size():totable()
+        end)
+      assert.are.same({1, 24, 32}, sizes[1])
+    end)
+
+    it('should write packed frames to an output file', function()
+      local outfile = os.tmpname()
+      local n_frames = torchvid.parallel_decode(path, {threads = 2}, outfile)
+      local file = io.open(outfile, 'rb')
+      local size = file:seek('end')
+      file:close()
+      os.remove(outfile)
+      assert.are.same(n_frames * 3 * 240 * 320, size)
+    end)
+
+    it('should detach frames kept after the callback returns', function()
+      local kept
+      torchvid.parallel_decode(path, {threads = 2}, function(frame)
+        kept = kept or frame
+      end)
+      assert.is_number(kept:timestamp())
+      assert.has_error(function() kept:to_byte_tensor() end)
+    end)
+
+    it('should reject option values which do not fit in an int', function()
+      local noop = function() end
+      assert.has_error(function()
+        torchvid.parallel_decode(path, {threads = 2^40}, noop)
+      end)
+      assert.has_error(function()
+        torchvid.parallel_decode(path, {threads = 2, buffered_segments = 2^40}, noop)
+      end)
+    end)
+
+    it('should propagate errors raised by the callback', function()
+      assert.has_error(function()
+        torchvid.parallel_decode(path, {threads = 2}, function(frame)
+          error('stop')
+        end)
+      end)
+    end)
+  end)
+
   describe('ImageFrame', function()
     local video
 
@@ -83,6 +334,30 @@ describe('torchvid', function()
       end)
     end)
 
+    describe(':change_score', function()
+      it('should be nil when change detection is disabled', function()
+        assert.is_nil(video:next_image_frame():change_score())
+      end)
+
+      it('should score the first frame as a complete change', function()
+        local scored_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          change_detection = 'luma'
+        })
+        assert.are.same(1, scored_video:next_image_frame():change_score())
+        local score = scored_video:next_image_frame():change_score()
+        assert.is_true(score >= 0 and score < 1)
+      end)
+
+      it('should support scoring by packet size', function()
+        local scored_video = torchvid.Video.new('./test/data/centaur_1.mpg', {
+          change_detection = 'packet_size'
+        })
+        assert.are.same(1, scored_video:next_image_frame():change_score())
+        local score = scored_video:next_image_frame():change_score()
+        assert.is_true(score >= 0 and score <= 1)
+      end)
+    end)
+
     describe(':to_byte_tensor', function()
       it('should return a ByteTensor of the correct dimensions', function()
         local frame = video:next_image_frame()
@@ -114,6 +389,29 @@ describe('torchvid', function()
 
         assert.are.same(expected, actual)
       end)
+
+      it('should pack only the requested crop region', function()
+        local frame = video:next_image_frame()
+        local expected = frame:to_byte_tensor():narrow(2, 21, 50):narrow(3, 11, 40)
+        local actual = frame:to_byte_tensor{x = 10, y = 20, width = 40, height = 50}
+        assert.are.same(expected:totable(), actual:totable())
+      end)
+
+      it('should sample every nth pixel when given a stride', function()
+        local frame = video:next_image_frame()
+        local full = frame:to_byte_tensor()
+        local expected = full:index(2, torch.range(2, 240, 3):long())
+          :index(3, torch.range(4, 320, 3):long())
+        local actual = frame:to_byte_tensor{x = 3, y = 1, stride = 3}
+        assert.are.same(expected:totable(), actual:totable())
+      end)
+
+      it('should reject crop regions outside the frame', function()
+        local frame = video:next_image_frame()
+        assert.has_error(function()
+          frame:to_byte_tensor{x = 300, width = 40}
+        end)
+      end)
     end)
 
     describe(':to_float_tensor', function()
@@ -148,4 +446,100 @@ describe('torchvid', function()
       end)
     end)
   end)
+
+  describe('VideoWriter', function()
+    local path = './test/data/centaur_1.mpg'
+
+    -- os.tmpname creates the file it names, so remove it and use a path with
+    -- the container extension next to it
+    local function tmp_video_path()
+      local base = os.tmpname()
+      os.remove(base)
+      return base .. '.mkv'
+    end
+
+    local function read_tensors(video_path, n_frames, pixel_format)
+      local video = torchvid.Video.new(video_path):filter(pixel_format)
+      local tensors = {}
+      for i = 1, n_frames do
+        tensors[i] = video:next_image_frame():to_byte_tensor()
+      end
+      return tensors
+    end
+
+    it('should round trip frames through a lossless codec', function()
+      local outfile = tmp_video_path()
+      local expected = read_tensors(path, 5, 'yuv444p')
+
+      local writer = torchvid.VideoWriter.new(outfile, {
+        codec = 'ffv1',
+        pixel_format = 'yuv444p',
+        gop_size = 1
+      })
+      for i, tensor in ipairs(expected) do
+        writer:write(tensor)
+      end
+      writer:close()
+
+      local actual = read_tensors(outfile, 5, 'yuv444p')
+      os.remove(outfile)
+
+      for i = 1, 5 do
+        assert.are.same(expected[i]:totable(), actual[i]:totable())
+      end
+    end)
+
+    it('should accept float tensors', function()
+      local outfile = tmp_video_path()
+      local frame = torchvid.Video.new(path):filter('yuv420p'):next_image_frame()
+
+      local writer = torchvid.VideoWriter.new(outfile, {codec = 'ffv1'})
+      writer:write(frame:to_float_tensor())
+      writer:close()
+
+      local actual = read_tensors(outfile, 1, 'yuv420p')[1]
+      os.remove(outfile)
+
+      assert.are.same(frame:to_byte_tensor():totable(), actual:totable())
+    end)
+
+    it('should encode to a memory buffer', function()
+      local writer = torchvid.VideoWriter.new(nil, {
+        format = 'matroska',
+        codec = 'mpeg4',
+        pixel_format = 'rgb24'
+      })
+      for i = 1, 10 do
+        writer:write(torch.ByteTensor(3, 48, 64):fill(i * 20))
+      end
+      local data = writer:close()
+      assert.are.same('string', type(data))
+
+      local outfile = tmp_video_path()
+      local file = io.open(outfile, 'wb')
+      file:write(data)
+      file:close()
+      local actual = read_tensors(outfile, 10, 'rgb24')
+      os.remove(outfile)
+
+      for i = 1, 10 do
+        assert.are.same({3, 48, 64}, actual[i]:size():totable())
+        assert.is_near(i * 20, actual[i]:double():mean(), 4)
+      end
+    end)
+
+    it('should refuse to close without any frames', function()
+      local outfile = tmp_video_path()
+      local writer = torchvid.VideoWriter.new(outfile, {codec = 'ffv1'})
+      assert.has_error(function() writer:close() end)
+      assert.is_nil(io.open(outfile, 'rb'))
+    end)
+
+    it('should reject tensors of the wrong shape', function()
+      local writer = torchvid.VideoWriter.new(nil, {format = 'matroska'})
+      assert.has_error(function()
+        writer:write(torch.ByteTensor(1, 48, 64))
+      end)
+    end)
+  end)
 end)